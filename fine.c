@@ -20,13 +20,252 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <inttypes.h>
 
 #include <libjaylink/libjaylink.h>
 
 #include "helpers.h"
+#include "log.h"
+#include "transport.h"
+#include "metrics.h"
+#include "sink.h"
+#include "lz.h"
 #include "fine.h"
+#include "profile.h"
 
-extern struct jaylink_device_handle *devh;
+/* Everything a connection needs lives here, so that sessions on
+ * different probes can run on different threads.
+ */
+/* Running latency of a command, or of the data packets of a read or
+ * write, as in TCP retransmission timers: smoothed mean and smoothed
+ * mean deviation. The timeout is the mean plus four deviations, doubled
+ * after each transport failure until the next success, and kept within
+ * FINE_TIMEOUT_MIN and FINE_TIMEOUT_MAX. Erase and stub write take
+ * time in proportion to their range, so they are sampled per byte and
+ * the estimate is scaled by the size of the next request.
+ */
+struct fine_latency {
+	uint64_t mean_ns;
+	uint64_t dev_ns;
+	uint32_t samples;
+	uint8_t backoff;
+};
+
+#define FINE_LAT_WRITE_DATA		256
+#define FINE_LAT_READ_DATA		257
+#define FINE_LAT_NUM			258
+
+struct fine_session {
+	struct fine_transport *transport;
+	struct fine_queue queue;
+
+	/* timeout of the exchanges sent now, in ms */
+	uint32_t timeout;
+	struct fine_latency latency[FINE_LAT_NUM];
+
+	struct fine_profile profile;
+
+	/* what the board reported, for calibrating the model on it */
+	struct fine_mem_info mem;
+	bool have_mem;
+	bool stub;
+
+	/* prefix of the session's log records */
+	char tag[LOG_TAG_MAX];
+
+	/* set when the session opened the probe itself */
+	struct jaylink_context *ctx;
+	struct jaylink_device_handle *devh;
+};
+
+struct fine_session *fine_session_new(struct fine_transport *t)
+{
+	struct fine_session *s;
+
+	if (!t)
+		return NULL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		transport_free(t);
+		return NULL;
+	}
+
+	fine_set_transport(s, t);
+	s->timeout = FINE_TIMEOUT;
+	profile_init(&s->profile);
+
+	return s;
+}
+
+void fine_session_free(struct fine_session *s)
+{
+	if (!s)
+		return;
+
+	transport_free(s->transport);
+
+	if (s->devh)
+		jaylink_close(s->devh);
+	if (s->ctx)
+		jaylink_exit(s->ctx);
+
+	free(s);
+}
+
+/* Swap the transport, e.g. to wrap it. The old one is not freed. */
+void fine_set_transport(struct fine_session *s, struct fine_transport *t)
+{
+	s->transport = t;
+	fine_queue_init(&s->queue, t);
+}
+
+struct fine_transport *fine_get_transport(struct fine_session *s)
+{
+	return s->transport;
+}
+
+/* Name the session in its log records, e.g. after its probe or fixture
+ * slot. NULL or "" leaves them untagged.
+ */
+void fine_set_tag(struct fine_session *s, const char *tag)
+{
+	if (!tag) {
+		s->tag[0] = '\0';
+		return;
+	}
+
+	strncpy(s->tag, tag, LOG_TAG_MAX - 1);
+	s->tag[LOG_TAG_MAX - 1] = '\0';
+}
+
+const char *fine_get_tag(struct fine_session *s)
+{
+	return s->tag;
+}
+
+/* Area layout last read from the board, NULL until then */
+const struct fine_mem_info *fine_get_mem_info(struct fine_session *s)
+{
+	return s->have_mem ? &s->mem : NULL;
+}
+
+/* Whether the flash stub has been started on the board */
+bool fine_stub_started(struct fine_session *s)
+{
+	return s->stub;
+}
+
+/* Exchange sizes of the send and receive paths, see profile.h. 0 or
+ * more than the path takes stands for the largest.
+ */
+void fine_set_profile(struct fine_session *s, const struct fine_profile *profile)
+{
+	s->profile = *profile;
+
+	if (!s->profile.send_words || s->profile.send_words > PROFILE_SEND_WORDS_MAX)
+		s->profile.send_words = PROFILE_SEND_WORDS_MAX;
+	if (!s->profile.recv_words || s->profile.recv_words > PROFILE_RECV_WORDS_MAX)
+		s->profile.recv_words = PROFILE_RECV_WORDS_MAX;
+}
+
+/* Clock for timing commands and steps: the transport's, in a dry run */
+uint64_t fine_now_ns(struct fine_session *s)
+{
+	return transport_now_ns(s->transport);
+}
+
+/* Exchange whose answer is needed now: flushes whatever is queued */
+static int fine_io(struct fine_session *s, const uint8_t *out, uint8_t *in,
+		   uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	return fine_queue_result(&s->queue,
+		fine_queue_io(&s->queue, out, in, out_len, in_len, timeout));
+}
+
+static int fine_io_deferred(struct fine_session *s, const uint8_t *out,
+			    uint8_t *in, uint32_t out_len, uint32_t in_len,
+			    uint32_t timeout)
+{
+	int64_t handle = fine_queue_io(&s->queue, out, in, out_len, in_len, timeout);
+
+	return handle < 0 ? (int)handle : JAYLINK_OK;
+}
+
+static uint32_t fine_timeout(struct fine_session *s, int slot, uint32_t initial,
+			     uint64_t units)
+{
+	const struct fine_latency *lat = &s->latency[slot];
+	uint64_t ms;
+
+	if (!lat->samples)
+		return initial;
+
+	ms = ((lat->mean_ns + 4 * lat->dev_ns) * units + 999999) / 1000000;
+	ms <<= lat->backoff;
+
+	if (ms < FINE_TIMEOUT_MIN)
+		return FINE_TIMEOUT_MIN;
+	if (ms > FINE_TIMEOUT_MAX)
+		return FINE_TIMEOUT_MAX;
+
+	return ms;
+}
+
+/* Only successes are sampled: a failed operation says nothing about how
+ * long it would have taken, but a transport failure may be a timeout
+ * set too short.
+ */
+static void fine_latency_update(struct fine_session *s, int slot, uint64_t ns,
+				int ret, uint64_t units)
+{
+	struct fine_latency *lat = &s->latency[slot];
+	uint64_t err;
+
+	if (ret != EXIT_SUCCESS) {
+		if (s->queue.error && lat->backoff < 8)
+			lat->backoff++;
+		return;
+	}
+
+	lat->backoff = 0;
+	ns /= units;
+
+	if (!lat->samples++) {
+		lat->mean_ns = ns;
+		lat->dev_ns = ns / 2;
+		return;
+	}
+
+	err = ns > lat->mean_ns ? ns - lat->mean_ns : lat->mean_ns - ns;
+	lat->mean_ns = lat->mean_ns - lat->mean_ns / 8 + ns / 8;
+	lat->dev_ns = lat->dev_ns - lat->dev_ns / 4 + err / 4;
+}
+
+void fine_transport_report(struct fine_session *s)
+{
+	const struct fine_queue *q = &s->queue;
+
+	if (!q->total_flushes)
+		return;
+
+	printf("FINE: %" PRIu64 " transactions in %" PRIu64 " exchanges (%.1f per exchange)\n",
+		q->total_ops, q->total_flushes,
+		(double)q->total_ops / q->total_flushes);
+
+	for (int i = 0; i < FINE_LAT_NUM; i++) {
+		const struct fine_latency *lat = &s->latency[i];
+		const struct fine_cmd_desc *desc = i < 256 ? fine_cmd_lookup(i) : NULL;
+
+		if (!lat->samples)
+			continue;
+
+		LOG_TAG_DEBUG(s->tag, "FINE: %-16s timeout %5" PRIu32 " ms, mean %.3f ms, deviation %.3f ms",
+			      desc ? desc->name : i == FINE_LAT_WRITE_DATA ? "write data" : "read data",
+			      fine_timeout(s, i, FINE_TIMEOUT, 1), lat->mean_ns / 1e6,
+			      lat->dev_ns / 1e6);
+	}
+}
 
 const char *fine_strerror(int error_code)
 {
@@ -70,116 +309,129 @@ const char *fine_strerror(int error_code)
 	}
 }
 
-int init_jlink(enum jaylink_target_interface iface, struct jaylink_context *ctx)
+/* Open a J-Link, the first one found when serial_number is 0, and
+ * select its FINE interface.
+ */
+struct fine_session *fine_session_open_jlink(uint32_t serial_number)
 {
-	size_t count;
-	int ret = jaylink_init(&ctx);
+	struct jaylink_context *ctx;
+	struct jaylink_device_handle *devh = NULL;
+	struct jaylink_device **devs;
+	struct fine_session *s;
+	uint32_t interfaces;
+	uint32_t tmp;
+	char *firmware_version;
+	size_t length;
+	int ret;
 
+	ret = jaylink_init(&ctx);
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_init() failed: %s.",jaylink_strerror_name(ret));
-		return -1;
+		LOG_ERROR("jaylink_init() failed: %s.", jaylink_strerror_name(ret));
+		return NULL;
 	}
 
 	ret = jaylink_discovery_scan(ctx, 0);
-
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_discovery_scan() failed: %s.\n",
+		LOG_ERROR("jaylink_discovery_scan() failed: %s.",
 			jaylink_strerror_name(ret));
 		jaylink_exit(ctx);
-		return EXIT_FAILURE;
+		return NULL;
 	}
 
-	struct jaylink_device **devs;
 	ret = jaylink_get_devices(ctx, &devs, NULL);
-
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_get_device_list() failed: %s.\n",
+		LOG_ERROR("jaylink_get_device_list() failed: %s.",
 			jaylink_strerror_name(ret));
 		jaylink_exit(ctx);
-		return EXIT_FAILURE;
+		return NULL;
 	}
 
-	uint32_t tmp;
-	bool device_found = false;
-	uint32_t serial_number;
-
 	for (int i = 0; devs[i]; i++) {
-		devh = NULL;
 		ret = jaylink_device_get_serial_number(devs[i], &tmp);
-
 		if (ret != JAYLINK_OK) {
-			printf("jaylink_device_get_serial_number() failed: "
-				"%s.\n", jaylink_strerror_name(ret));
+			LOG_ERROR("jaylink_device_get_serial_number() failed: "
+				"%s.", jaylink_strerror_name(ret));
 			continue;
 		}
 
-		ret = jaylink_open(devs[i], &devh);
+		if (serial_number && tmp != serial_number)
+			continue;
 
+		ret = jaylink_open(devs[i], &devh);
 		if (ret == JAYLINK_OK) {
 			serial_number = tmp;
-			device_found = true;
 			break;
 		}
 
-		printf("jaylink_open() failed: %s.\n",
+		devh = NULL;
+		LOG_ERROR("jaylink_open() failed: %s.",
 			jaylink_strerror_name(ret));
 	}
 
 	jaylink_free_devices(devs, true);
 
-	if (!device_found) {
-		printf("No J-Link device found.\n");
+	if (!devh) {
+		LOG_ERROR("No J-Link device found.");
 		jaylink_exit(ctx);
-		return EXIT_SUCCESS;
+		return NULL;
+	}
+
+	s = fine_session_new(transport_jaylink_new(devh));
+	if (!s) {
+		jaylink_close(devh);
+		jaylink_exit(ctx);
+		return NULL;
 	}
 
+	/* From here on, fine_session_free() closes the probe */
+	s->ctx = ctx;
+	s->devh = devh;
+
 	printf("S/N: %012u\n", serial_number);
 
-	char *firmware_version;
-	size_t length;
 	ret = jaylink_get_firmware_version(devh, &firmware_version, &length);
-
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_get_firmware_version() failed: %s.\n",
+		LOG_ERROR("jaylink_get_firmware_version() failed: %s.",
 			jaylink_strerror_name(ret));
-		jaylink_close(devh);
-		jaylink_exit(ctx);
-		return EXIT_FAILURE;
+		goto err;
 	} else if (length > 0) {
 		printf("Firmware: %s\n", firmware_version);
 		free(firmware_version);
 	}
 
-	uint32_t interfaces;
 	ret = jaylink_get_available_interfaces(devh, &interfaces);
-
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_get_available_interfaces() failed: %s",
+		LOG_ERROR("jaylink_get_available_interfaces() failed: %s",
 			jaylink_strerror(ret));
-		return EXIT_FAILURE;
+		goto err;
 	}
 
-	if (!(interfaces & (1 << iface))) {
-		printf("Selected transport (FINE) is not supported by the device");
-		return EXIT_FAILURE;
+	if (!(interfaces & (1 << JAYLINK_TIF_FINE))) {
+		LOG_ERROR("Selected transport (FINE) is not supported by the device");
+		goto err;
 	}
 
 	jaylink_clear_reset(devh);
 	jaylink_set_reset(devh);
 
-	ret = jaylink_select_interface(devh, iface, NULL);
-
+	ret = jaylink_select_interface(devh, JAYLINK_TIF_FINE, NULL);
 	if (ret < 0) {
-		printf("jaylink_select_interface() failed: %s",
+		LOG_ERROR("jaylink_select_interface() failed: %s",
 			jaylink_strerror(ret));
-		return EXIT_FAILURE;
+		goto err;
 	}
 
 	jaylink_set_reset(devh);
 	jaylink_jtag_set_trst(devh);
+
+	return s;
+
+err:
+	fine_session_free(s);
+	return NULL;
 }
 
-int fine_get_chip_id(void)
+int fine_get_chip_id(struct fine_session *s)
 {
 	uint8_t out[16];
 	uint8_t in[8];
@@ -188,6 +440,9 @@ int fine_get_chip_id(void)
 	int ret;
 	int retry = 0;
 
+	/* New connection: forget errors left by a previous target */
+	fine_queue_reset(&s->queue);
+
 	buf_set_u32_be(out, 0, FINE_START_SEQ);
 
 	memset(in, 0, 2);
@@ -195,33 +450,56 @@ int fine_get_chip_id(void)
 
 	/* When target receive FINE_START_SEQ, it responds 0x23 0x02 */
 	while ((retry < FINE_RETRY_ID_COUNT) && memcmp(in, expected, 2)) {
-		ret = jaylink_fine_io(devh, out, in, 4, 2, FINE_TIMEOUT);
+		if (retry)
+			metrics_retry();
+		ret = fine_io(s, out, in, 4, 2, FINE_TIMEOUT);
 		if (ret != JAYLINK_OK) {
-			printf("Error during FINE xfer");
+			LOG_TAG_ERROR(s->tag, "Error during FINE xfer");
 			return ret;
 		}
 		retry++;
 	}
 
 	if (retry == FINE_RETRY_ID_COUNT) {
-		printf("Couldn't init FINE");
+		LOG_TAG_ERROR(s->tag, "Couldn't init FINE");
 		return EXIT_FAILURE;
 	}
 
 	out[0] = FINE_GET_CHIP_ID;
-	ret = jaylink_fine_io(devh, out, in, 1, 2, FINE_TIMEOUT);
+	ret = fine_io(s, out, in, 1, 2, FINE_TIMEOUT);
 	if (ret != JAYLINK_OK) {
-		printf("Error during FINE xfer");
+		LOG_TAG_ERROR(s->tag, "Error during FINE xfer");
 		return ret;
 	}
 
-	buf_bswap16(in, in, 2);
-	printf("Found chip id %s\n", buf_to_hex_str(in, 16));
+	printf("Found chip id %04x\n", be_to_h_u16(in));
 
 	return EXIT_SUCCESS;
 }
 
-int fine_init_chip(void)
+/* Cheap presence check: a single start sequence, as sent by
+ * fine_get_chip_id(s). A target in boot mode answers 0x23 0x02.
+ */
+int fine_probe_target(struct fine_session *s, bool *present)
+{
+	uint8_t out[4];
+	uint8_t in[2] = { 0 };
+	int ret;
+
+	fine_queue_reset(&s->queue);
+
+	buf_set_u32_be(out, 0, FINE_START_SEQ);
+
+	ret = fine_io(s, out, in, 4, 2, FINE_TIMEOUT);
+	if (ret != JAYLINK_OK)
+		return ret;
+
+	*present = in[0] == 0x23 && in[1] == 0x02;
+
+	return EXIT_SUCCESS;
+}
+
+int fine_init_chip(struct fine_session *s)
 {
 	uint8_t out[16];
 	uint8_t in[8];
@@ -240,9 +518,9 @@ int fine_init_chip(void)
 	out[8] = 0x00;
 	out[9] = FINE_ASK_TARGET_ACK;
 
-	ret = jaylink_fine_io(devh, out, in, 10, 2, FINE_TIMEOUT);
+	ret = fine_io(s, out, in, 10, 2, FINE_TIMEOUT);
 	if (ret != JAYLINK_OK) {
-		printf("Error during FINE xfer");
+		LOG_TAG_ERROR(s->tag, "Error during FINE xfer");
 		return ret;
 	}
 
@@ -251,7 +529,7 @@ int fine_init_chip(void)
 	if (memcmp(expected, in, 2)) {
 		buf_set_u32(expected, 0, 16, 0x0020);
 		if (memcmp(expected, in, 2)) {
-			printf("Error during FINE initialization");
+			LOG_TAG_ERROR(s->tag, "Error during FINE initialization");
 			return EXIT_FAILURE;
 		}
 	}
@@ -262,38 +540,41 @@ int fine_init_chip(void)
 	out[3] = 0x00;
 	out[4] = 0x00;
 
-	ret = jaylink_fine_io(devh, out, in, 5, 1, FINE_TIMEOUT);
+	ret = fine_io(s, out, in, 5, 1, FINE_TIMEOUT);
 	if (ret != JAYLINK_OK) {
-		printf("Error during FINE xfer");
+		LOG_TAG_ERROR(s->tag, "Error during FINE xfer");
 		return ret;
 	}
 
 	if (in[0]) {
-		printf("Error during FINE initialization");
+		LOG_TAG_ERROR(s->tag, "Error during FINE initialization");
 		return EXIT_FAILURE;
 	}
 
 	out[0] = FINE_ASK_TARGET_DATA;
 	in[0] = 0x0E;
 	while ((in[0] == 0x0E) && (retry < 100)) {
-		ret = jaylink_fine_io(devh, out, in, 1, 1, 0x64);
+		if (retry) {
+			metrics_retry();
+			usleep(10000);
+		}
+		ret = fine_io(s, out, in, 1, 1, FINE_TIMEOUT);
 		if (ret != JAYLINK_OK) {
-			printf("jaylink_fine_io failed: %s", jaylink_strerror(ret));
+			LOG_TAG_ERROR(s->tag, "jaylink_fine_io failed: %s", jaylink_strerror(ret));
 			return EXIT_FAILURE;
 		}
 		retry++;
-		usleep(10000);
 	}
 
 	if (retry == 100) {
-		printf("FINE: device timeout");
+		LOG_TAG_ERROR(s->tag, "FINE: device timeout");
 		return EXIT_FAILURE;
 	}
 
 	out[0] = FINE_ASK_TARGET_ACK;
-	ret = jaylink_fine_io(devh, out, in, 1, 2, 0x64);
+	ret = fine_io(s, out, in, 1, 2, FINE_TIMEOUT);
 	if (ret != JAYLINK_OK) {
-		printf("jaylink_fine_io failed: %s", jaylink_strerror(ret));
+		LOG_TAG_ERROR(s->tag, "jaylink_fine_io failed: %s", jaylink_strerror(ret));
 		return EXIT_FAILURE;
 	}
 
@@ -303,15 +584,15 @@ int fine_init_chip(void)
 	return EXIT_SUCCESS;
 }
 
-static int fine_send_cmd_ack(void)
+static int fine_send_cmd_ack(struct fine_session *s)
 {
 	uint8_t out = FINE_ASK_TARGET_ACK;
 	uint8_t in[2];
 	int ret;
 
-	ret = jaylink_fine_io(devh, &out, in, 1, 2, 0x64);
+	ret = fine_io(s, &out, in, 1, 2, s->timeout);
 	if (ret != JAYLINK_OK) {
-		printf("fine_send_cmd_continue failed: %s", jaylink_strerror(ret));
+		LOG_TAG_ERROR(s->tag, "fine_send_cmd_continue failed: %s", jaylink_strerror(ret));
 		return EXIT_FAILURE;
 	}
 
@@ -321,116 +602,114 @@ static int fine_send_cmd_ack(void)
 	return EXIT_SUCCESS;
 }
 
-static int fine_send_cmd(uint8_t cmd_status, uint8_t cmd, uint8_t *data, uint16_t data_len)
+/* Acknowledge without waiting for the answer */
+static int fine_queue_ack(struct fine_session *s)
 {
-	uint8_t out[5];
-	uint8_t in[2];
-	int idx = 0;
-	int ret;
+	uint8_t out = FINE_ASK_TARGET_ACK;
 
-	out[0] = 0x84;
-	out[1] = FINE_CMD_SOH | cmd_status;
-	out[2] = (data_len + 1) >> 8;
-	out[3] = (data_len + 1) & 0xFF;
-	out[4] = cmd;
+	return fine_io_deferred(s, &out, NULL, 1, 2, s->timeout);
+}
 
+/* Build a FINE packet: SOH (SOD for PKT_STATUS), length, command, data,
+ * sum and ETX. buf must hold data_len + FINE_FRAME_OVERHEAD bytes.
+ */
+int fine_frame_packet(uint8_t *buf, uint8_t cmd_status, uint8_t cmd,
+		      const uint8_t *data, uint16_t data_len)
+{
 	uint8_t crc = 0;
-	for (int i = 0; i < 3; i++)
-		crc += out[2 + i];
-	for (int i = 0; i < data_len; i++)
-		crc += data[i];
-	crc = ~crc + 1;
 
-	ret = jaylink_fine_io(devh, out, in, 5, 1, 0x64);
-	if (ret != JAYLINK_OK) {
-		printf("jaylink_fine_io failed: %s", jaylink_strerror(ret));
-		return EXIT_FAILURE;
-	}
+	buf[0] = FINE_CMD_SOH | cmd_status;
+	buf[1] = (data_len + 1) >> 8;
+	buf[2] = (data_len + 1) & 0xFF;
+	buf[3] = cmd;
+	if (data_len)
+		memcpy(&buf[4], data, data_len);
+
+	for (int i = 1; i < data_len + 4; i++)
+		crc += buf[i];
 
-	fine_send_cmd_ack();
+	buf[data_len + 4] = ~crc + 1;
+	buf[data_len + 5] = FINE_CMD_ETX;
 
-	while (data_len > 3) {
-		memcpy(&out[1], &data[idx], 4);
-		ret = jaylink_fine_io(devh, out, in, 5, 1, 0x64);
+	return data_len + FINE_FRAME_OVERHEAD;
+}
+
+/* Send a framed packet four bytes at a time, acking every word but the
+ * last. The packet is queued and sent send_words words per exchange, its
+ * tail going out with the next exchange that needs an answer, usually
+ * the status packet read.
+ */
+int fine_send_frame(struct fine_session *s, const uint8_t *frame, uint32_t len)
+{
+	uint8_t out[5];
+	uint32_t words = 0;
+	int ret = JAYLINK_OK;
+
+	out[0] = 0x84;
+
+	for (uint32_t idx = 0; idx < len; idx += 4) {
+		uint32_t n = len - idx < 4 ? len - idx : 4;
+
+		memset(&out[1], 0, 4);
+		memcpy(&out[1], &frame[idx], n);
+
+		ret = fine_io_deferred(s, out, NULL, 5, 1, s->timeout);
 		if (ret != JAYLINK_OK) {
-			printf("jaylink_fine_io failed: %s", jaylink_strerror(ret));
+			LOG_TAG_ERROR(s->tag, "jaylink_fine_io failed: %s", jaylink_strerror(ret));
 			return EXIT_FAILURE;
 		}
 
-		idx += 4;
-		data_len -= 4;
-
-		fine_send_cmd_ack();
-	}
-
-	memset(&out[1], 0, 4);
-	switch (data_len) {
-	case 0:
-		out[1] = crc;
-		out[2] = FINE_CMD_ETX;
-		break;
-	case 1:
-		out[1] = data[idx];
-		out[2] = crc;
-		out[3] = FINE_CMD_ETX;
-		break;
-	case 2:
-		out[1] = data[idx];
-		out[2] = data[idx + 1];
-		out[3] = crc;
-		out[4] = FINE_CMD_ETX;
-		break;
-	case 3:
-		out[1] = data[idx];
-		out[2] = data[idx + 1];
-		out[3] = data[idx + 2];
-		out[4] = crc;
-		break;
-	}
-
-	ret = jaylink_fine_io(devh, out, in, 5, 1, 0x64);
-
-	if (data_len == 3) {
-		fine_send_cmd_ack();
-		out[1] = FINE_CMD_ETX;
-		out[2] = 0;
-		out[3] = 0;
-		out[4] = 0;
-		ret = jaylink_fine_io(devh, out, in, 5, 1, 0x64);
+		if (idx + 4 >= len)
+			break;
+
+		fine_queue_ack(s);
+
+		if (++words == s->profile.send_words) {
+			words = 0;
+			ret = fine_queue_flush(&s->queue);
+			if (ret != JAYLINK_OK) {
+				LOG_TAG_ERROR(s->tag, "jaylink_fine_io failed: %s", jaylink_strerror(ret));
+				return EXIT_FAILURE;
+			}
+		}
 	}
 
 	return EXIT_SUCCESS;
 }
 
-static int fine_get_status_packet(void)
+static int fine_send_cmd(struct fine_session *s, uint8_t cmd_status, uint8_t cmd,
+			 uint8_t *data, uint16_t data_len)
+{
+	uint8_t frame[FINE_MAX_DATA_LEN + FINE_FRAME_OVERHEAD];
+
+	if (data_len > FINE_MAX_DATA_LEN)
+		return EXIT_FAILURE;
+
+	return fine_send_frame(s, frame, fine_frame_packet(frame, cmd_status, cmd,
+							data, data_len));
+}
+
+static int fine_get_status_packet(struct fine_session *s)
 {
 	uint8_t out[5];
-	uint8_t in[5];
+	uint8_t in[2][5];
 	uint8_t status[8];
 
 	int ret;
 
+	/* Both words and the ack go out in a single exchange */
 	out[0] = FINE_ASK_TARGET_DATA;
-	ret = jaylink_fine_io(devh, out, in, 1, 5, 0x64);
-	if (ret != JAYLINK_OK) {
-		printf("fine_get_status_packet failed: %s", jaylink_strerror(ret));
-		return EXIT_FAILURE;
-	}
+	fine_io_deferred(s, out, in[0], 1, 5, s->timeout);
+	fine_io_deferred(s, out, in[1], 1, 5, s->timeout);
 
-	memcpy(status, &in[1], 4);
-
-	out[0] = FINE_ASK_TARGET_DATA;
-	ret = jaylink_fine_io(devh, out, in, 1, 5, 0x64);
-	if (ret != JAYLINK_OK) {
-		printf("fine_get_status_packet failed: %s", jaylink_strerror(ret));
-		return EXIT_FAILURE;
+	ret = fine_send_cmd_ack(s);
+	if (ret != EXIT_SUCCESS) {
+		LOG_TAG_ERROR(s->tag, "fine_get_status_packet failed");
+		return ret;
 	}
 
-	memcpy(&status[4], &in[1], 4);
-
-	ret = fine_send_cmd_ack();
-	if (ret != EXIT_SUCCESS)
-		return ret;
+	memcpy(status, &in[0][1], 4);
+	memcpy(&status[4], &in[1][1], 4);
 
 	if (!(status[3] & 0x80))
 		return EXIT_SUCCESS;
@@ -438,278 +717,704 @@ static int fine_get_status_packet(void)
 	return status[4];
 }
 
-static int fine_get_data(uint8_t *buffer)
+/* Target data words, as answered to FINE_ASK_TARGET_DATA: a status
+ * byte then four bytes of the target packet. The decoder takes them
+ * straight from the exchange buffer, checks the packet (length, sum,
+ * ETX) and hands the payload to out in as few writes as possible.
+ */
+#define FINE_DATA_WORD_LEN		5
+#define FINE_DATA_WORDS_MAX		PROFILE_RECV_WORDS_MAX
+
+struct fine_decoder {
+	struct fine_sink sink;
+	struct fine_sink *out;
+	uint32_t max;			/* largest payload accepted */
+	uint32_t pos;			/* packet bytes seen */
+	uint32_t len;			/* payload length, once the header is in */
+	uint8_t hdr[4];			/* SOD, length, RES */
+	uint8_t sum;
+	uint8_t etx;
+	int error;
+};
+
+static int fine_decoder_write(struct fine_sink *sink, const uint8_t *data,
+			      uint32_t len)
 {
-	uint8_t out[5];
-	uint8_t in[5];
-	int nb_xfer;
+	struct fine_decoder *dec = (struct fine_decoder *)sink;
+	uint8_t chunk[256];
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < len; i++) {
+		uint32_t pos;
+		uint8_t b;
+
+		/* Skip the status byte of every word */
+		if (!(i % FINE_DATA_WORD_LEN))
+			continue;
+
+		b = data[i];
+		pos = dec->pos++;
+
+		if (pos < 4) {
+			dec->hdr[pos] = b;
+			if (pos)
+				dec->sum += b;
+			if (pos == 3) {
+				dec->len = ((dec->hdr[1] << 8) | dec->hdr[2]) - 1;
+				if (!((dec->hdr[1] << 8) | dec->hdr[2]) || dec->len > dec->max)
+					dec->error = FINE_CMD_ERR_PACKET;
+			}
+		} else if (dec->error) {
+			continue;
+		} else if (pos < 4 + dec->len) {
+			dec->sum += b;
+			/* An error packet carries its code, not a payload */
+			if (dec->hdr[3] & 0x80) {
+				dec->error = b;
+				continue;
+			}
+			chunk[n++] = b;
+			if (n == sizeof(chunk)) {
+				if (fine_sink_write(dec->out, chunk, n) != EXIT_SUCCESS)
+					dec->error = EXIT_FAILURE;
+				n = 0;
+			}
+		} else if (pos == 4 + dec->len) {
+			dec->sum += b;
+		} else if (pos == 5 + dec->len) {
+			dec->etx = b;
+		}
+	}
+
+	if (n && !dec->error && fine_sink_write(dec->out, chunk, n) != EXIT_SUCCESS)
+		dec->error = EXIT_FAILURE;
+
+	return dec->error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void fine_decoder_init(struct fine_decoder *dec, struct fine_sink *out,
+			      uint32_t max)
+{
+	memset(dec, 0, sizeof(*dec));
+	dec->sink.write = fine_decoder_write;
+	dec->out = out;
+	dec->max = max;
+}
+
+static int fine_decoder_finish(struct fine_decoder *dec)
+{
+	if (!dec->error && dec->pos < dec->len + FINE_FRAME_OVERHEAD)
+		dec->error = FINE_CMD_ERR_PACKET;
+	else if (!dec->error && dec->sum)
+		dec->error = FINE_CMD_ERR_CHECKSUM;
+	else if (!dec->error && dec->etx != FINE_CMD_ETX)
+		dec->error = FINE_CMD_ERR_PACKET;
+
+	if (dec->error > EXIT_FAILURE)
+		LOG_ERROR("FINE: bad response: %s", fine_strerror(dec->error));
+
+	return dec->error;
+}
+
+/* Read the target packet of a data phase, its payload going to out.
+ * Returns the payload length or -1.
+ */
+static int fine_get_data(struct fine_session *s, struct fine_sink *out, uint32_t max)
+{
+	uint8_t cmds[FINE_DATA_WORDS_MAX];
+	uint8_t first[FINE_DATA_WORD_LEN];
+	struct fine_decoder dec;
+	uint32_t words;
 	int ret;
 
-	out[0] = FINE_ASK_TARGET_DATA;
-	ret = jaylink_fine_io(devh, out, in, 1, 5, 0x64);
+	fine_decoder_init(&dec, out, max);
+
+	/* The first word tells how many follow */
+	cmds[0] = FINE_ASK_TARGET_DATA;
+	ret = fine_io(s, cmds, first, 1, FINE_DATA_WORD_LEN, s->timeout);
 	if (ret != JAYLINK_OK) {
-		printf("fine_get_status_packet failed: %s", jaylink_strerror(ret));
-		return EXIT_FAILURE;
+		LOG_TAG_ERROR(s->tag, "fine_get_data failed: %s", jaylink_strerror(ret));
+		return -1;
+	}
+
+	fine_decoder_write(&dec.sink, first, FINE_DATA_WORD_LEN);
+	if (dec.error) {
+		fine_decoder_finish(&dec);
+		return -1;
 	}
 
-	memcpy(buffer, &in[1], 4);
+	/* The length is known now: queue the remaining words, recv_words
+	 * per exchange, the last ones going out with the ack
+	 */
+	memset(cmds, FINE_ASK_TARGET_DATA, sizeof(cmds));
+	words = (dec.len + FINE_FRAME_OVERHEAD + 3) / 4 - 1;
 
-	int len = 4;
+	while (words) {
+		uint32_t n = words < s->profile.recv_words ? words : s->profile.recv_words;
+		int64_t handle = fine_queue_io_sink(&s->queue, cmds, &dec.sink, n,
+						    n * FINE_DATA_WORD_LEN, s->timeout);
 
-	nb_xfer = ((in[2] << 8) + in[3] + 1) / 4;
-	if ((in[3] + 1) % 4)
-		nb_xfer++;
+		if (handle < 0) {
+			LOG_TAG_ERROR(s->tag, "fine_get_data failed: %s", jaylink_strerror(handle));
+			return -1;
+		}
 
-	for (int i = 0; i < nb_xfer; i++) {
-		out[0] = FINE_ASK_TARGET_DATA;
-		ret = jaylink_fine_io(devh, out, in, 1, 5, 0x64);
+		words -= n;
+		ret = words ? fine_queue_flush(&s->queue) : JAYLINK_OK;
 		if (ret != JAYLINK_OK) {
-			printf("fine_get_status_packet failed: %s", jaylink_strerror(ret));
-			return EXIT_FAILURE;
+			LOG_TAG_ERROR(s->tag, "fine_get_data failed: %s", jaylink_strerror(ret));
+			return -1;
 		}
+	}
 
-		memcpy(&buffer[4 + (i * 4)], &in[1], 4);
+	fine_queue_ack(s);
 
-		len += 4;
+	ret = fine_queue_flush(&s->queue);
+	if (ret != JAYLINK_OK) {
+		LOG_TAG_ERROR(s->tag, "fine_get_data failed: %s", jaylink_strerror(ret));
+		return -1;
 	}
 
-	fine_send_cmd_ack();
+	if (fine_decoder_finish(&dec))
+		return -1;
 
-	return len;
+	return dec.len;
 }
 
-int fine_get_device_type(void)
+static int fine_decode_device_type(const uint8_t *data, int len, void *resp)
 {
-	int ret;
-	uint8_t buff[200];
+	struct fine_device_type *dt = resp;
 
-	printf("FINE: Get device type\n");
+	if (len < 24)
+		return FINE_CMD_ERR_PACKET;
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_GET_DEVICE_TYPE, NULL, 0);
-	if (ret != EXIT_SUCCESS)
-		return ret;
+	memcpy(dt->type, data, 8);
+	dt->max_input_clk = buf_get_u32_be(data, 8);
+	dt->min_input_clk = buf_get_u32_be(data, 12);
+	dt->max_sys_clk = buf_get_u32_be(data, 16);
+	dt->min_sys_clk = buf_get_u32_be(data, 20);
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE error: %s", fine_strerror(ret));
-		return ret;
-	}
+	return EXIT_SUCCESS;
+}
 
-	ret = fine_send_cmd(PKT_STATUS, FINE_CMD_GET_DEVICE_TYPE, NULL, 0);
-	if (ret != EXIT_SUCCESS)
-		return ret;
+static int fine_decode_frequency(const uint8_t *data, int len, void *resp)
+{
+	struct fine_frequency *freq = resp;
 
-	if (fine_get_data(buff) < 0)
-		return EXIT_FAILURE;
+	if (len < 8)
+		return FINE_CMD_ERR_PACKET;
 
-	printf("max_input_clk_freq = %d\n", buf_get_u32_be(buff, 12));
-	printf("min_input_clk_freq = %d\n", buf_get_u32_be(buff, 16));
-	printf("max_sys_clk_freq   = %d\n", buf_get_u32_be(buff, 20));
-	printf("min_sys_clk_freq   = %d\n", buf_get_u32_be(buff, 24));
+	freq->sys_clk = buf_get_u32_be(data, 0);
+	freq->periph_clk = buf_get_u32_be(data, 4);
 
+	return EXIT_SUCCESS;
+}
 
-	//memcpy(rx_device->type, &buff[4], 8);
+static int fine_decode_auth_mode(const uint8_t *data, int len, void *resp)
+{
+	struct fine_auth_mode *auth = resp;
+
+	if (len < 1)
+		return FINE_CMD_ERR_PACKET;
 
+	auth->mode = data[0];
+	auth->serial_boot_allowed = data[0] ? false : true;
 
 	return EXIT_SUCCESS;
 }
 
-int fine_set_endianness(int endianness)
+static int fine_decode_u8(const uint8_t *data, int len, void *resp)
 {
-	uint8_t val = endianness == TARGET_LITTLE_ENDIAN ? 1 : 0;
-	int ret;
+	if (len < 1)
+		return FINE_CMD_ERR_PACKET;
 
-	printf("FINE: Set endianness\n");
+	*(uint8_t *)resp = data[0];
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_SET_ENDIANNSESS, &val, 1);
-	if (ret != EXIT_SUCCESS)
-		return ret;
+	return EXIT_SUCCESS;
+}
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s\n", fine_strerror(ret));
-		return ret;
-	}
+static int fine_decode_area_info(const uint8_t *data, int len, void *resp)
+{
+	struct fine_area_info *area = resp;
+
+	if (len < 17)
+		return FINE_CMD_ERR_PACKET;
+
+	area->koa = data[0];
+	area->sad = buf_get_u32_be(data, 1);
+	area->ead = buf_get_u32_be(data, 5);
+	area->eau = buf_get_u32_be(data, 9);
+	area->wau = buf_get_u32_be(data, 13);
 
 	return EXIT_SUCCESS;
 }
 
-int fine_set_frequency(int in_freq, int sys_freq)
+/* req_len:  request payload length, after the command byte
+ * resp_len: minimum response payload length, after the RES byte.
+ *           Zero means the command has no data phase.
+ * timeout:  until the command latency has been measured
+ */
+static const struct fine_cmd_desc fine_cmds[] = {
+	{ FINE_CMD_SYNC,		"sync",			0,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_ERASE,		"erase",		8,	0,	FINE_TIMEOUT_MAX,	NULL },
+	{ FINE_CMD_WRITE,		"write",		8,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_READ,		"read",			8,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_GET_AUTH_MODE,	"get auth mode",	0,	1,	FINE_TIMEOUT,		fine_decode_auth_mode },
+	{ FINE_CMD_CHECK_ID_CODE,	"check ID code",	16,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_SET_FREQUENCY,	"set frequency",	8,	8,	FINE_TIMEOUT,		fine_decode_frequency },
+	{ FINE_CMD_SET_BITRATE,		"set bitrate",		4,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_SET_ENDIANNSESS,	"set endianness",	1,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_GET_DEVICE_TYPE,	"get device type",	0,	24,	FINE_TIMEOUT,		fine_decode_device_type },
+	{ FINE_CMD_GET_AREA_COUNT,	"get area count",	0,	1,	FINE_TIMEOUT,		fine_decode_u8 },
+	{ FINE_CMD_GET_AREA_INFO,	"get area info",	1,	17,	FINE_TIMEOUT,		fine_decode_area_info },
+	{ FINE_CMD_STUB_LOAD,		"stub load",		8,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_STUB_RUN,		"stub run",		4,	0,	FINE_TIMEOUT,		NULL },
+	{ FINE_CMD_STUB_WRITE,		"stub write",		0,	0,	FINE_TIMEOUT_MAX,	NULL },
+};
+
+const struct fine_cmd_desc *fine_cmd_lookup(uint8_t cmd)
 {
-	uint8_t buff[100];
-	uint8_t out[8];
+	for (size_t i = 0; i < sizeof(fine_cmds) / sizeof(fine_cmds[0]); i++) {
+		if (fine_cmds[i].cmd == cmd)
+			return &fine_cmds[i];
+	}
+
+	return NULL;
+}
+
+/* Run one command: command packet, status packet and, if the command has
+ * one, the data phase. The data phase is always drained to keep the
+ * target in sync, but only decoded when resp is not NULL.
+ */
+static int fine_exec_one(struct fine_session *s, const struct fine_cmd_desc *desc,
+			 const void *req, uint16_t req_len, void *resp);
+
+/* Bytes an erase goes through, 1 for the commands whose time is fixed */
+static uint64_t fine_exec_units(uint8_t cmd, const void *req, uint16_t req_len)
+{
+	uint32_t sad, ead;
+
+	if (cmd != FINE_CMD_ERASE || req_len != 8)
+		return 1;
+
+	sad = buf_get_u32_be(req, 0);
+	ead = buf_get_u32_be(req, 4);
+
+	return ead >= sad ? (uint64_t)ead - sad + 1 : 1;
+}
+
+int fine_exec(struct fine_session *s, uint8_t cmd, const void *req,
+	      uint16_t req_len, void *resp)
+{
+	const struct fine_cmd_desc *desc = fine_cmd_lookup(cmd);
+	uint64_t units = fine_exec_units(cmd, req, req_len);
+	uint64_t start = fine_now_ns(s);
 	int ret;
 
-	printf("FINE: Set frequency\n");
+	if (!desc) {
+		LOG_TAG_ERROR(s->tag, "FINE: unknown command 0x%02x", cmd);
+		return EXIT_FAILURE;
+	}
 
-	buf_set_u32_be(out, 0, in_freq * 1000000);
-	buf_set_u32_be(out, 4, sys_freq * 1000000);
+	s->timeout = fine_timeout(s, cmd, desc->timeout, units);
+	ret = fine_exec_one(s, desc, req, req_len, resp);
+	s->timeout = FINE_TIMEOUT;
+
+	fine_latency_update(s, cmd, fine_now_ns(s) - start, ret, units);
+	metrics_command(cmd, fine_now_ns(s) - start, ret);
+
+	return ret;
+}
+
+static int fine_exec_one(struct fine_session *s, const struct fine_cmd_desc *desc,
+			 const void *req, uint16_t req_len, void *resp)
+{
+	uint8_t cmd = desc->cmd;
+	uint8_t payload[FINE_MAX_DATA_LEN];
+	struct fine_sink_mem mem;
+	int len;
+	int ret;
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_SET_FREQUENCY, out, 8);
+	if (req_len != desc->req_len) {
+		LOG_TAG_ERROR(s->tag, "FINE: %s expects %d request bytes, got %d",
+			      desc->name, desc->req_len, req_len);
+		return EXIT_FAILURE;
+	}
+
+	LOG_TAG_DEBUG(s->tag, "FINE: %s", desc->name);
+
+	ret = fine_send_cmd(s, PKT_CMD, cmd, (uint8_t *)req, req_len);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	ret = fine_get_status_packet();
+	ret = fine_get_status_packet(s);
 	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s", fine_strerror(ret));
+		LOG_TAG_ERROR(s->tag, "FINE %s error: %s", desc->name, fine_strerror(ret));
 		return ret;
 	}
 
-	ret = fine_send_cmd(PKT_STATUS, FINE_CMD_SET_FREQUENCY, NULL, 0);
+	if (!desc->resp_len)
+		return EXIT_SUCCESS;
+
+	ret = fine_send_cmd(s, PKT_STATUS, cmd, NULL, 0);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
+	fine_sink_mem_init(&mem, payload, sizeof(payload));
 
-	if (fine_get_data(buff) < 0)
+	len = fine_get_data(s, &mem.sink, sizeof(payload));
+	if (len < 0)
 		return EXIT_FAILURE;
 
-	printf("System frequency set to     %d\n", buf_get_u32_be(buff, 4));
-	printf("Peripheral frequency set to %d\n", buf_get_u32_be(buff, 8));
+	if (len < desc->resp_len) {
+		LOG_TAG_ERROR(s->tag, "FINE %s: short response (%d bytes)", desc->name, len);
+		return EXIT_FAILURE;
+	}
+
+	if (resp)
+		return desc->decode(payload, len, resp);
 
 	return EXIT_SUCCESS;
 }
 
-int fine_set_bitrate(int bitrate)
+int fine_get_device_type(struct fine_session *s, struct fine_device_type *dt)
 {
-	uint8_t out[4];
-	int ret;
+	return fine_exec(s, FINE_CMD_GET_DEVICE_TYPE, NULL, 0, dt);
+}
+
+int fine_set_endianness(struct fine_session *s, int endianness)
+{
+	uint8_t val = endianness == TARGET_LITTLE_ENDIAN ? 1 : 0;
+
+	return fine_exec(s, FINE_CMD_SET_ENDIANNSESS, &val, 1, NULL);
+}
+
+int fine_set_frequency(struct fine_session *s, int in_freq, int sys_freq,
+		       struct fine_frequency *freq)
+{
+	uint8_t out[8];
 
-	printf("FINE: Set bitrate\n");
+	buf_set_u32_be(out, 0, in_freq * 1000000);
+	buf_set_u32_be(out, 4, sys_freq * 1000000);
+
+	return fine_exec(s, FINE_CMD_SET_FREQUENCY, out, 8, freq);
+}
+
+int fine_set_bitrate(struct fine_session *s, int bitrate)
+{
+	uint8_t out[4];
 
 	buf_set_u32_be(out, 0, bitrate);
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_SET_BITRATE, out, 4);
+	return fine_exec(s, FINE_CMD_SET_BITRATE, out, 4, NULL);
+}
+
+int fine_send_sync(struct fine_session *s)
+{
+	return fine_exec(s, FINE_CMD_SYNC, NULL, 0, NULL);
+}
+
+int fine_get_serial_protect_state(struct fine_session *s, struct fine_auth_mode *auth)
+{
+	return fine_exec(s, FINE_CMD_GET_AUTH_MODE, NULL, 0, auth);
+}
+
+int fine_check_id_code(struct fine_session *s, uint8_t *id)
+{
+	return fine_exec(s, FINE_CMD_CHECK_ID_CODE, id, 16, NULL);
+}
+
+int fine_get_device_mem_info(struct fine_session *s, struct fine_mem_info *info)
+{
+	uint8_t count;
+	int ret;
+
+	ret = fine_exec(s, FINE_CMD_GET_AREA_COUNT, NULL, 0, &count);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s\n", fine_strerror(ret));
-		return ret;
+	if (count > FINE_MAX_AREAS) {
+		LOG_TAG_ERROR(s->tag, "FINE: too many areas (%d)", count);
+		return EXIT_FAILURE;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		ret = fine_exec(s, FINE_CMD_GET_AREA_INFO, &i, 1, &info->area[i]);
+		if (ret != EXIT_SUCCESS)
+			return ret;
 	}
 
+	info->area_count = count;
+
+	s->mem = *info;
+	s->have_mem = true;
+
 	return EXIT_SUCCESS;
 }
 
-int fine_send_sync(void)
+int fine_erase(struct fine_session *s, uint32_t sad, uint32_t ead)
 {
+	uint8_t out[8];
+
+	buf_set_u32_be(out, 0, sad);
+	buf_set_u32_be(out, 4, ead);
+
+	return fine_exec(s, FINE_CMD_ERASE, out, 8, NULL);
+}
+
+/* The write command announces the range, then the data follows in
+ * packets of at most FINE_MAX_DATA_LEN bytes, each one acknowledged
+ * by a status packet.
+ */
+int fine_write(struct fine_session *s, uint32_t sad, const uint8_t *data, uint32_t len)
+{
+	uint8_t out[8];
+	uint32_t n;
 	int ret;
 
-	printf("FINE: Send sync\n");
+	buf_set_u32_be(out, 0, sad);
+	buf_set_u32_be(out, 4, sad + len - 1);
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_SYNC, NULL, 0);
+	ret = fine_exec(s, FINE_CMD_WRITE, out, 8, NULL);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s\n", fine_strerror(ret));
-		return ret;
+	while (len) {
+		n = len > FINE_MAX_DATA_LEN ? FINE_MAX_DATA_LEN : len;
+
+		ret = fine_send_cmd(s, PKT_STATUS, FINE_CMD_WRITE, (uint8_t *)data, n);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+
+		ret = fine_get_status_packet(s);
+		if (ret != EXIT_SUCCESS) {
+			LOG_TAG_ERROR(s->tag, "FINE write error: %s", fine_strerror(ret));
+			return ret;
+		}
+
+		data += n;
+		len -= n;
 	}
 
 	return EXIT_SUCCESS;
 }
 
-int fine_get_serial_protect_state(void)
+/* Stream a memory range to sink as it comes off the wire */
+int fine_read_sink(struct fine_session *s, uint32_t sad, uint32_t len,
+		   struct fine_sink *sink)
 {
-	uint8_t buff[8];
+	uint8_t out[8];
+	int n;
 	int ret;
 
-	printf("FINE: Get authentication mode\n");
+	buf_set_u32_be(out, 0, sad);
+	buf_set_u32_be(out, 4, sad + len - 1);
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_GET_AUTH_MODE, NULL, 0);
+	ret = fine_exec(s, FINE_CMD_READ, out, 8, NULL);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s", fine_strerror(ret));
-		return ret;
+	s->timeout = fine_timeout(s, FINE_LAT_READ_DATA, FINE_TIMEOUT, 1);
+
+	while (len) {
+		uint64_t start = fine_now_ns(s);
+
+		ret = fine_send_cmd(s, PKT_STATUS, FINE_CMD_READ, NULL, 0);
+		if (ret != EXIT_SUCCESS)
+			break;
+
+		n = fine_get_data(s, sink, len);
+		if (n <= 0) {
+			LOG_TAG_ERROR(s->tag, "FINE: bad read response");
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		fine_latency_update(s, FINE_LAT_READ_DATA, fine_now_ns(s) - start, ret, 1);
+		len -= n;
 	}
 
-	ret = fine_send_cmd(PKT_STATUS, FINE_CMD_GET_AUTH_MODE, NULL, 0);
 	if (ret != EXIT_SUCCESS)
-		return ret;
+		fine_latency_update(s, FINE_LAT_READ_DATA, 0, ret, 1);
+	s->timeout = FINE_TIMEOUT;
 
-	if (fine_get_data(buff) < 0)
-		return EXIT_FAILURE;
+	return ret;
+}
 
-	printf("Serial boot allowed = %d\n", buff[4] ? 0 : 1);
+int fine_read(struct fine_session *s, uint32_t sad, uint8_t *data, uint32_t len)
+{
+	struct fine_sink_mem mem;
 
-	return EXIT_SUCCESS;
+	fine_sink_mem_init(&mem, data, len);
+
+	return fine_read_sink(s, sad, len, &mem.sink);
 }
 
-int fine_check_id_code(uint8_t *id)
+/* Same as fine_write(s), with the data packets already framed back to
+ * back in frames, as built by fine_frame_packet().
+ */
+int fine_write_frames(struct fine_session *s, uint32_t sad, uint32_t len,
+		      const uint8_t *frames, uint32_t frames_len)
 {
 	int ret;
 
-	printf("FINE: Check ID code\n");
-
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_CHECK_ID_CODE, id, 16);
+	ret = fine_write_begin(s, sad, len);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s\n", fine_strerror(ret));
-		return ret;
-	}
+	return fine_write_packets(s, frames, frames_len);
+}
 
-	return EXIT_SUCCESS;
+/* The two halves of fine_write_frames(), for data packets that are not
+ * contiguous: the write command, then any number of runs of packets
+ * covering the range in order.
+ */
+int fine_write_begin(struct fine_session *s, uint32_t sad, uint32_t len)
+{
+	uint8_t out[8];
+
+	buf_set_u32_be(out, 0, sad);
+	buf_set_u32_be(out, 4, sad + len - 1);
+
+	return fine_exec(s, FINE_CMD_WRITE, out, 8, NULL);
 }
 
-int fine_get_device_mem_info(void)
+int fine_write_packets(struct fine_session *s, const uint8_t *frames,
+		       uint32_t frames_len)
 {
-	uint8_t buff[24];
-	int ret;
+	uint32_t off = 0;
+	int ret = EXIT_SUCCESS;
 
-	printf("FINE: Get area informations\n");
+	s->timeout = fine_timeout(s, FINE_LAT_WRITE_DATA, FINE_TIMEOUT, 1);
 
-	ret = fine_send_cmd(PKT_CMD, FINE_CMD_GET_AREA_COUNT, NULL, 0);
-	if (ret != EXIT_SUCCESS)
-		return ret;
+	while (off < frames_len) {
+		uint32_t n = ((frames[off + 1] << 8) | frames[off + 2]) - 1 +
+			     FINE_FRAME_OVERHEAD;
+		uint64_t start = fine_now_ns(s);
 
-	ret = fine_get_status_packet();
-	if (ret != EXIT_SUCCESS) {
-		printf("FINE command error: %s", fine_strerror(ret));
-		return ret;
+		if (off + n > frames_len) {
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		ret = fine_send_frame(s, &frames[off], n);
+		if (ret != EXIT_SUCCESS)
+			break;
+
+		ret = fine_get_status_packet(s);
+		fine_latency_update(s, FINE_LAT_WRITE_DATA, fine_now_ns(s) - start, ret, 1);
+		if (ret != EXIT_SUCCESS) {
+			LOG_TAG_ERROR(s->tag, "FINE write error: %s", fine_strerror(ret));
+			break;
+		}
+
+		off += n;
 	}
 
-	ret = fine_send_cmd(PKT_STATUS, FINE_CMD_GET_AREA_COUNT, NULL, 0);
+	s->timeout = FINE_TIMEOUT;
+
+	return ret;
+}
+
+/* Load the flash stub into RAM at addr, the same way as a write, and
+ * start it there. Returns FINE_CMD_ERR_NOT_SUPPORTED, with the boot
+ * firmware still in charge, when the target can't take a stub.
+ */
+int fine_stub_start(struct fine_session *s, uint32_t addr, const uint8_t *code,
+		    uint32_t len)
+{
+	uint8_t frame[FINE_MAX_DATA_LEN + FINE_FRAME_OVERHEAD];
+	uint8_t out[8];
+	int ret;
+
+	buf_set_u32_be(out, 0, addr);
+	buf_set_u32_be(out, 4, addr + len - 1);
+
+	ret = fine_exec(s, FINE_CMD_STUB_LOAD, out, 8, NULL);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
-	if (fine_get_data(buff) < 0)
-		return EXIT_FAILURE;
+	for (uint32_t off = 0; off < len; off += FINE_MAX_DATA_LEN) {
+		uint32_t n = len - off;
 
-	int area_count = buff[4];
+		if (n > FINE_MAX_DATA_LEN)
+			n = FINE_MAX_DATA_LEN;
 
-	for (uint8_t i = 0; i < area_count; i++) {
-		printf("FINE: Area %d Information Acquisition Command\n", i);
-
-		ret = fine_send_cmd(PKT_CMD, FINE_CMD_GET_AREA_INFO, &i, 1);
+		ret = fine_send_frame(s, frame, fine_frame_packet(frame, PKT_STATUS,
+								  FINE_CMD_STUB_LOAD,
+								  &code[off], n));
 		if (ret != EXIT_SUCCESS)
 			return ret;
 
-		ret = fine_get_status_packet();
+		ret = fine_get_status_packet(s);
 		if (ret != EXIT_SUCCESS) {
-			printf("FINE command error: %s", fine_strerror(ret));
+			LOG_TAG_ERROR(s->tag, "FINE stub load error: %s", fine_strerror(ret));
 			return ret;
 		}
+	}
 
-		ret = fine_send_cmd(PKT_STATUS, FINE_CMD_GET_AREA_INFO, NULL, 0);
-		if (ret != EXIT_SUCCESS)
-			return ret;
+	ret = fine_exec(s, FINE_CMD_STUB_RUN, out, 4, NULL);
+	if (ret == EXIT_SUCCESS)
+		s->stub = true;
 
-		if (fine_get_data(buff) < 0)
-			return EXIT_FAILURE;
+	return ret;
+}
+
+/* Write through the running stub: one packet per FINE_STUB_BLOCK bytes,
+ * compressed unless that makes it larger, answered by a status packet
+ * once the block is programmed. sad and len follow the area write unit
+ * as for fine_write().
+ */
+int fine_stub_write(struct fine_session *s, uint32_t sad, const uint8_t *data,
+		    uint32_t len)
+{
+	const struct fine_cmd_desc *desc = fine_cmd_lookup(FINE_CMD_STUB_WRITE);
+	uint8_t *payload;
+	uint8_t *frame;
+	int ret = EXIT_SUCCESS;
+
+	payload = malloc(FINE_STUB_MAX_DATA_LEN);
+	frame = malloc(FINE_STUB_MAX_DATA_LEN + FINE_FRAME_OVERHEAD);
+	if (!payload || !frame) {
+		free(payload);
+		free(frame);
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t off = 0; off < len && ret == EXIT_SUCCESS; off += FINE_STUB_BLOCK) {
+		uint32_t n = len - off < FINE_STUB_BLOCK ? len - off : FINE_STUB_BLOCK;
+		uint32_t packed = lz_compress(&data[off], n, &payload[FINE_STUB_HDR_LEN]);
+		uint64_t start = fine_now_ns(s);
+
+		buf_set_u32_be(payload, 0, sad + off);
+		buf_set_u32_be(payload, 4, n);
+		payload[8] = FINE_STUB_LZ;
+
+		if (packed >= n) {
+			memcpy(&payload[FINE_STUB_HDR_LEN], &data[off], n);
+			payload[8] = FINE_STUB_RAW;
+			packed = n;
+		}
+
+		s->timeout = fine_timeout(s, FINE_CMD_STUB_WRITE, desc->timeout, n);
 
-		printf("area[%d].koa = %x\n", i, buff[4]);
-		printf("area[%d].sad = %x\n", i, buf_get_u32_be(buff, 5));
-		printf("area[%d].ead = %x\n", i, buf_get_u32_be(buff, 9));
-		printf("area[%d].eau = %x\n", i, buf_get_u32_be(buff, 13));
-		printf("area[%d].wau = %x\n", i, buf_get_u32_be(buff, 17));
+		ret = fine_send_frame(s, frame,
+				      fine_frame_packet(frame, PKT_CMD, FINE_CMD_STUB_WRITE,
+							payload, FINE_STUB_HDR_LEN + packed));
+		if (ret == EXIT_SUCCESS) {
+			ret = fine_get_status_packet(s);
+			if (ret != EXIT_SUCCESS)
+				LOG_TAG_ERROR(s->tag, "FINE stub write error: %s", fine_strerror(ret));
+		}
+
+		s->timeout = FINE_TIMEOUT;
+
+		fine_latency_update(s, FINE_CMD_STUB_WRITE, fine_now_ns(s) - start, ret, n);
+		metrics_command(FINE_CMD_STUB_WRITE, fine_now_ns(s) - start, ret);
 	}
 
-	return EXIT_SUCCESS;
-}
\ No newline at end of file
+	free(payload);
+	free(frame);
+
+	return ret;
+}
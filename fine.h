@@ -1,17 +1,33 @@
+#ifndef FINE_H
+#define FINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
 
 #define PKT_CMD				0
 #define PKT_STATUS			0x80
 
-#define FINE_TIMEOUT			0x64
+#define FINE_TIMEOUT			0x64	/* ms, outside of commands */
+#define FINE_TIMEOUT_MIN		10
+#define FINE_TIMEOUT_MAX		10000
 #define FINE_RETRY_ID_COUNT		10
 
 #define FINE_START_SEQ			0x9D4375C0
 
+/* Probe sub-commands, as sent to jaylink_fine_io() */
+#define FINE_OP_START			0x9D	/* first byte of FINE_START_SEQ */
+#define FINE_OP_CONFIG			0x88
+#define FINE_OP_WRITE			0x84	/* then a four byte packet word */
+
 #define FINE_GET_CHIP_ID		0xC2
 #define FINE_ASK_TARGET_ACK		0xC6
 #define FINE_ASK_TARGET_DATA		0xC4
 
 #define FINE_CMD_SYNC			0x00
+#define FINE_CMD_ERASE			0x12
+#define FINE_CMD_WRITE			0x13
+#define FINE_CMD_READ			0x15
 #define FINE_CMD_GET_AUTH_MODE		0x2C
 #define FINE_CMD_CHECK_ID_CODE		0x30
 #define FINE_CMD_SET_FREQUENCY		0x32
@@ -21,6 +37,17 @@
 #define FINE_CMD_GET_AREA_COUNT		0x53
 #define FINE_CMD_GET_AREA_INFO		0x54
 
+/* Flash stub. The boot firmware answers the load command with "not
+ * supported" unless it can take a stub into RAM; once running, the stub
+ * answers the boot commands above plus its own compressed write.
+ */
+#define FINE_CMD_STUB_LOAD		0x70
+#define FINE_CMD_STUB_RUN		0x71
+#define FINE_CMD_STUB_WRITE		0x72
+
+#define FINE_STUB_RAW			0
+#define FINE_STUB_LZ			1
+
 #define FINE_CMD_SOH			0x01
 #define FINE_CMD_ETX			0x03
 
@@ -44,14 +71,115 @@
 
 #define TARGET_LITTLE_ENDIAN		2
 
-int init_jlink(enum jaylink_target_interface iface, struct jaylink_context *ctx);
-int fine_get_chip_id(void);
-int fine_init_chip(void);
-int fine_get_device_type(void);
-int fine_set_endianness(int endianness);
-int fine_set_frequency(int in_freq, int sys_freq);
-int fine_set_bitrate(int bitrate);
-int fine_send_sync(void);
-int fine_get_serial_protect_state(void);
-int fine_check_id_code(uint8_t *id);
-int fine_get_device_mem_info(void);
+#define FINE_MAX_AREAS			16
+#define FINE_MAX_DATA_LEN		1024	/* write/read data packet payload */
+#define FINE_MAX_RESP_LEN		(FINE_MAX_DATA_LEN + 8)
+#define FINE_FRAME_OVERHEAD		6	/* SOH, length, command, sum, ETX */
+
+/* Stub write payload: address, length, method, then at most
+ * FINE_STUB_BLOCK bytes once decompressed
+ */
+#define FINE_STUB_BLOCK			16384
+#define FINE_STUB_HDR_LEN		9
+#define FINE_STUB_MAX_DATA_LEN		(FINE_STUB_HDR_LEN + FINE_STUB_BLOCK + \
+					 FINE_STUB_BLOCK / 255 + 16)
+
+struct fine_device_type {
+	uint8_t type[8];
+	uint32_t max_input_clk;
+	uint32_t min_input_clk;
+	uint32_t max_sys_clk;
+	uint32_t min_sys_clk;
+};
+
+struct fine_frequency {
+	uint32_t sys_clk;
+	uint32_t periph_clk;
+};
+
+struct fine_auth_mode {
+	uint8_t mode;
+	bool serial_boot_allowed;
+};
+
+struct fine_area_info {
+	uint8_t koa;		/* kind of area */
+	uint32_t sad;		/* start address */
+	uint32_t ead;		/* end address */
+	uint32_t eau;		/* erase access unit */
+	uint32_t wau;		/* write access unit */
+};
+
+struct fine_mem_info {
+	int area_count;
+	struct fine_area_info area[FINE_MAX_AREAS];
+};
+
+struct fine_cmd_desc {
+	uint8_t cmd;
+	const char *name;
+	uint16_t req_len;
+	uint16_t resp_len;
+	uint16_t timeout;		/* ms, until its latency is known */
+	int (*decode)(const uint8_t *data, int len, void *resp);
+};
+
+struct fine_transport;
+struct fine_sink;
+struct fine_profile;
+
+/* A connection to one target. Every call below takes the session it
+ * works on; sessions share no state, so each may be driven from its
+ * own thread.
+ */
+struct fine_session;
+
+struct fine_session *fine_session_new(struct fine_transport *t);
+struct fine_session *fine_session_open_jlink(uint32_t serial_number);
+void fine_session_free(struct fine_session *s);
+
+void fine_set_transport(struct fine_session *s, struct fine_transport *t);
+struct fine_transport *fine_get_transport(struct fine_session *s);
+void fine_set_tag(struct fine_session *s, const char *tag);
+const char *fine_get_tag(struct fine_session *s);
+const struct fine_mem_info *fine_get_mem_info(struct fine_session *s);
+bool fine_stub_started(struct fine_session *s);
+uint64_t fine_now_ns(struct fine_session *s);
+void fine_set_profile(struct fine_session *s, const struct fine_profile *profile);
+void fine_transport_report(struct fine_session *s);
+const char *fine_strerror(int error_code);
+const struct fine_cmd_desc *fine_cmd_lookup(uint8_t cmd);
+int fine_exec(struct fine_session *s, uint8_t cmd, const void *req,
+	      uint16_t req_len, void *resp);
+int fine_get_chip_id(struct fine_session *s);
+int fine_probe_target(struct fine_session *s, bool *present);
+int fine_init_chip(struct fine_session *s);
+int fine_get_device_type(struct fine_session *s, struct fine_device_type *dt);
+int fine_set_endianness(struct fine_session *s, int endianness);
+int fine_set_frequency(struct fine_session *s, int in_freq, int sys_freq,
+		       struct fine_frequency *freq);
+int fine_set_bitrate(struct fine_session *s, int bitrate);
+int fine_send_sync(struct fine_session *s);
+int fine_get_serial_protect_state(struct fine_session *s, struct fine_auth_mode *auth);
+int fine_check_id_code(struct fine_session *s, uint8_t *id);
+int fine_get_device_mem_info(struct fine_session *s, struct fine_mem_info *info);
+int fine_erase(struct fine_session *s, uint32_t sad, uint32_t ead);
+int fine_write(struct fine_session *s, uint32_t sad, const uint8_t *data,
+	       uint32_t len);
+int fine_read(struct fine_session *s, uint32_t sad, uint8_t *data, uint32_t len);
+int fine_read_sink(struct fine_session *s, uint32_t sad, uint32_t len,
+		   struct fine_sink *sink);
+int fine_frame_packet(uint8_t *buf, uint8_t cmd_status, uint8_t cmd,
+		      const uint8_t *data, uint16_t data_len);
+int fine_send_frame(struct fine_session *s, const uint8_t *frame, uint32_t len);
+int fine_write_frames(struct fine_session *s, uint32_t sad, uint32_t len,
+		      const uint8_t *frames, uint32_t frames_len);
+int fine_write_begin(struct fine_session *s, uint32_t sad, uint32_t len);
+int fine_stub_start(struct fine_session *s, uint32_t addr, const uint8_t *code,
+		    uint32_t len);
+int fine_stub_write(struct fine_session *s, uint32_t sad, const uint8_t *data,
+		    uint32_t len);
+int fine_write_packets(struct fine_session *s, const uint8_t *frames,
+		       uint32_t frames_len);
+
+#endif /* FINE_H */
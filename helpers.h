@@ -21,13 +21,14 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
 
 char *buf_to_hex_str(const void *_buf, unsigned buf_len);
 
 static inline uint32_t buf_get_u32_be(const uint8_t *_buffer, int offset)
 {
 	const uint8_t *buffer = _buffer;
-	return (buffer[offset] << 24) + (buffer[offset + 1] << 16) + (buffer[offset + 2] << 8) + buffer[offset + 3];
+	return ((uint32_t)buffer[offset] << 24) + (buffer[offset + 1] << 16) + (buffer[offset + 2] << 8) + buffer[offset + 3];
 }
 
 static inline void buf_set_u32_be(uint8_t *_buffer, int offset, uint32_t val)
@@ -129,4 +130,13 @@ static inline void buf_bswap16(uint8_t *dst, const uint8_t *src, size_t len)
 		uint16_t x = be_to_h_u16(src + n);
 		h_u16_to_le(dst + n, x);
 	}
-}
\ No newline at end of file
+}
+
+static inline uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
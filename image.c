@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "log.h"
+#include "image.h"
+
+static int image_add(struct image *image, uint32_t addr, const uint8_t *data,
+		     uint32_t size)
+{
+	struct image_section *sec;
+
+	/* S-records are usually emitted in order: extend the last section */
+	if (image->num_sections) {
+		sec = &image->sections[image->num_sections - 1];
+		if (sec->addr + sec->size == addr) {
+			uint8_t *tmp = realloc(sec->data, sec->size + size);
+			if (!tmp)
+				return EXIT_FAILURE;
+			memcpy(tmp + sec->size, data, size);
+			sec->data = tmp;
+			sec->size += size;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	sec = realloc(image->sections,
+		      (image->num_sections + 1) * sizeof(*sec));
+	if (!sec)
+		return EXIT_FAILURE;
+	image->sections = sec;
+
+	sec = &image->sections[image->num_sections];
+	sec->data = malloc(size);
+	if (!sec->data)
+		return EXIT_FAILURE;
+	memcpy(sec->data, data, size);
+	sec->addr = addr;
+	sec->size = size;
+	image->num_sections++;
+
+	return EXIT_SUCCESS;
+}
+
+static int hex_byte(const char *s)
+{
+	char tmp[3] = { s[0], s[1], 0 };
+	char *end;
+	long val = strtol(tmp, &end, 16);
+
+	if (end != tmp + 2)
+		return -1;
+
+	return val;
+}
+
+static int image_load_srec(struct image *image, FILE *f, const char *path)
+{
+	char line[600];
+	uint8_t rec[256];
+	int lineno = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		int addr_len;
+		int count;
+		uint8_t sum = 0;
+
+		lineno++;
+
+		if (line[0] != 'S')
+			continue;
+
+		switch (line[1]) {
+		case '1':
+			addr_len = 2;
+			break;
+		case '2':
+			addr_len = 3;
+			break;
+		case '3':
+			addr_len = 4;
+			break;
+		default:
+			/* header, count and start address records */
+			continue;
+		}
+
+		count = hex_byte(&line[2]);
+		if (count < addr_len + 1 || (int)strlen(line) < 4 + count * 2)
+			goto bad_record;
+
+		for (int i = 0; i < count; i++) {
+			int b = hex_byte(&line[4 + i * 2]);
+			if (b < 0)
+				goto bad_record;
+			rec[i] = b;
+			sum += b;
+		}
+
+		sum += count;
+		if (sum != 0xFF) {
+			LOG_ERROR("%s:%d: bad S-record checksum", path, lineno);
+			return EXIT_FAILURE;
+		}
+
+		uint32_t addr = 0;
+		for (int i = 0; i < addr_len; i++)
+			addr = (addr << 8) | rec[i];
+
+		if (image_add(image, addr, &rec[addr_len], count - addr_len - 1))
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+
+bad_record:
+	LOG_ERROR("%s:%d: malformed S-record", path, lineno);
+	return EXIT_FAILURE;
+}
+
+static int image_load_binary(struct image *image, FILE *f, uint32_t base_addr)
+{
+	uint8_t *data;
+	long size;
+	int ret;
+
+	if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET))
+		return EXIT_FAILURE;
+
+	data = malloc(size ? size : 1);
+	if (!data)
+		return EXIT_FAILURE;
+
+	if (fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		return EXIT_FAILURE;
+	}
+
+	ret = image_add(image, base_addr, data, size);
+	free(data);
+
+	return ret;
+}
+
+int image_load(struct image *image, const char *path, const uint32_t *base_addr)
+{
+	FILE *f;
+	int ret;
+
+	memset(image, 0, sizeof(*image));
+
+	f = fopen(path, base_addr ? "rb" : "r");
+	if (!f) {
+		LOG_ERROR("Can't open %s", path);
+		return EXIT_FAILURE;
+	}
+
+	if (base_addr)
+		ret = image_load_binary(image, f, *base_addr);
+	else
+		ret = image_load_srec(image, f, path);
+
+	fclose(f);
+
+	if (ret == EXIT_SUCCESS && !image->num_sections) {
+		LOG_ERROR("%s: no data", path);
+		ret = EXIT_FAILURE;
+	}
+
+	if (ret != EXIT_SUCCESS)
+		image_free(image);
+
+	return ret;
+}
+
+void image_free(struct image *image)
+{
+	for (int i = 0; i < image->num_sections; i++)
+		free(image->sections[i].data);
+
+	free(image->sections);
+	image->sections = NULL;
+	image->num_sections = 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+struct image_section {
+	uint32_t addr;
+	uint32_t size;
+	uint8_t *data;
+};
+
+struct image {
+	int num_sections;
+	struct image_section *sections;
+};
+
+/* Motorola S-record (.mot/.srec/.s19) or, when base_addr is given, raw
+ * binary loaded at base_addr.
+ */
+int image_load(struct image *image, const char *path, const uint32_t *base_addr);
+void image_free(struct image *image);
+
+#endif /* IMAGE_H */
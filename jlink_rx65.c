@@ -35,67 +35,521 @@
 #include <stdbool.h>
 #include <string.h>
 #include <inttypes.h>
+#include <getopt.h>
 
 #include <libjaylink/libjaylink.h>
 #include "helpers.h"
+#include "log.h"
 #include "fine.h"
-
-struct jaylink_device_handle *devh;
-static struct jaylink_context *ctx;
+#include "transport.h"
+#include "sim.h"
+#include "job.h"
+#include "station.h"
+#include "metrics.h"
+#include "model.h"
+#include "trace.h"
+#include "plan.h"
+#include "profile.h"
 
 uint8_t id_code[16] = {
 	0x33, 0x22, 0x11, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
 };
 
-int main(void)
+static bool use_sim;
+static uint32_t sim_absent_ms, sim_present_ms;
+static bool sim_stub;
+static bool station;
+static int station_boards;
+static const char *cache_dir;
+static struct fine_model model;
+static bool have_model;
+static bool dry_run;
+static const char *calibrate_path;
+static const char *record_path;
+static const char *replay_path;
+static bool replay_fast;
+static const char *compile_path;
+static struct fine_profile profile;
+static bool have_profile;
+static const char *bench_path;
+static unsigned long check_percent;
+
+static const struct option long_options[] = {
+	{ "sim",	no_argument,		NULL, 's' },
+	{ "sim-plug",	required_argument,	NULL, 'p' },
+	{ "sim-stub",	no_argument,		NULL, 'T' },
+	{ "station",	optional_argument,	NULL, 'S' },
+	{ "metrics",	required_argument,	NULL, 'm' },
+	{ "metrics-port", required_argument,	NULL, 'M' },
+	{ "cache",	required_argument,	NULL, 'c' },
+	{ "model",	required_argument,	NULL, 'o' },
+	{ "dry-run",	no_argument,		NULL, 'n' },
+	{ "calibrate",	required_argument,	NULL, 'C' },
+	{ "record",	required_argument,	NULL, 'r' },
+	{ "replay",	required_argument,	NULL, 'R' },
+	{ "replay-fast", no_argument,		NULL, 'F' },
+	{ "compile",	required_argument,	NULL, 'P' },
+	{ "profile",	required_argument,	NULL, 'f' },
+	{ "bench",	required_argument,	NULL, 'b' },
+	{ "check-model", optional_argument,	NULL, 'K' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ NULL,		0,			NULL, 0 },
+};
+
+static void usage(const char *name)
 {
-	int ret;
+	printf("usage: %s [options] [job-file]\n", name);
+	printf("  -s, --sim                  use the simulated target instead of a J-Link\n");
+	printf("      --sim-plug=ABSENT:PRESENT\n");
+	printf("                             simulated boards come and go (ms)\n");
+	printf("      --sim-stub             simulated boards can run a flash stub\n");
+	printf("      --station[=BOARDS]     run the job on every board put in the fixture\n");
+	printf("      --metrics=FILE         write Prometheus metrics to FILE\n");
+	printf("      --metrics-port=PORT    serve Prometheus metrics on 127.0.0.1:PORT\n");
+	printf("      --cache=DIR            keep prepared firmware images in DIR\n");
+	printf("      --model=FILE           timing model for --dry-run and the simulator\n");
+	printf("  -n, --dry-run              predict the job cycle time, no target needed\n");
+	printf("      --calibrate=FILE       fit the timing model to this run, save it to FILE\n");
+	printf("      --record=FILE          save every exchange to a trace FILE\n");
+	printf("      --replay=FILE          serve the exchanges of a trace instead of a target\n");
+	printf("      --replay-fast          replay without waiting, on the trace's clock\n");
+	printf("      --compile=FILE         compile the job into a flash plan FILE and exit\n");
+	printf("      --profile=FILE         exchange sizes of the probe, from --bench\n");
+	printf("      --bench=FILE           time the job's paths by exchange size, save the\n");
+	printf("                             fastest to profile FILE\n");
+	printf("      --check-model[=PERCENT]\n");
+	printf("                             run the job on the simulator, fail if it\n");
+	printf("                             takes more than PERCENT (5) off the model\n");
+}
+
+static struct fine_session *open_target(void)
+{
+	struct fine_session *s;
+
+	if (dry_run) {
+		s = fine_session_new(sim_new());
+		if (s) {
+			sim_set_model(fine_get_transport(s), &model, false);
+			sim_set_stub(fine_get_transport(s), sim_stub);
+		}
+	} else if (use_sim) {
+		s = fine_session_new(sim_new());
+		if (s && (sim_absent_ms || sim_present_ms))
+			sim_set_plug_cycle(fine_get_transport(s), sim_absent_ms,
+					   sim_present_ms);
+		if (s && have_model)
+			sim_set_model(fine_get_transport(s), &model, true);
+		if (s)
+			sim_set_stub(fine_get_transport(s), sim_stub);
+	} else if (replay_path) {
+		s = fine_session_new(trace_replay_new(replay_path, !replay_fast));
+	} else
+		s = fine_session_open_jlink(0);
+
+	if (s && record_path) {
+		struct fine_transport *t = trace_record_new(fine_get_transport(s),
+							    record_path);
+
+		if (!t) {
+			fine_session_free(s);
+			return NULL;
+		}
+		fine_set_transport(s, t);
+	}
+
+	if (s && calibrate_path) {
+		struct fine_transport *t = model_capture_new(fine_get_transport(s));
+
+		if (!t) {
+			fine_session_free(s);
+			return NULL;
+		}
+		fine_set_transport(s, t);
+	}
+
+	if (s && have_profile)
+		fine_set_profile(s, &profile);
 
-	init_jlink(JAYLINK_TIF_FINE, ctx);
+	return s;
+}
 
-	ret = fine_get_chip_id();
+static void close_target(struct fine_session *s)
+{
+	fine_transport_report(s);
+	metrics_flush();
+
+	if (dry_run) {
+		uint64_t cost[MODEL_NUM_COSTS];
+
+		sim_get_costs(fine_get_transport(s), cost);
+		model_report(cost);
+	}
+
+	if (calibrate_path &&
+	    model_calibrate(fine_get_transport(s), &model, fine_get_mem_info(s),
+			    fine_stub_started(s)) == EXIT_SUCCESS)
+		model_save(&model, calibrate_path);
+
+	fine_session_free(s);
+}
+
+static int run_job(const char *path)
+{
+	struct fine_session *s;
+	struct job job;
+	int ret;
+
+	/* Validate everything before touching the probe */
+	ret = job_load(&job, path, cache_dir);
 	if (ret != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 
-	ret = fine_init_chip();
-	if (ret != EXIT_SUCCESS)
+	s = open_target();
+	if (!s) {
+		job_free(&job);
 		return EXIT_FAILURE;
+	}
+
+	if (station) {
+		ret = station_run(s, &job, station_boards, STATION_POLL_MS);
+	} else {
+		ret = job_run(&job, s);
+		job_report(&job);
+	}
+
+	job_free(&job);
 
-	ret = fine_get_device_type();
+	close_target(s);
+
+	return ret == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int compile_job(const char *path)
+{
+	struct job job;
+	int ret;
+
+	ret = job_load(&job, path, cache_dir);
 	if (ret != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 
-	ret = fine_set_endianness(TARGET_LITTLE_ENDIAN);
-	if (ret != EXIT_SUCCESS)
+	if (job.plan_map) {
+		LOG_ERROR("%s is already a plan", path);
+		job_free(&job);
 		return EXIT_FAILURE;
+	}
+
+	ret = plan_compile(&job, &model, have_profile ? &profile : NULL, compile_path);
 
-	ret = fine_set_frequency(16, 120);
+	job_free(&job);
+
+	return ret;
+}
+
+static int bench_job(const char *path)
+{
+	struct fine_profile best;
+	struct fine_session *s;
+	struct job job;
+	int ret;
+
+	ret = job_load(&job, path, cache_dir);
 	if (ret != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 
-	ret = fine_set_bitrate(1000000);
-	if (ret != EXIT_SUCCESS)
+	if (job.plan_map) {
+		LOG_ERROR("%s: a plan has fixed exchanges, benchmark its job", path);
+		job_free(&job);
 		return EXIT_FAILURE;
+	}
 
-	ret = fine_send_sync();
-	if (ret != EXIT_SUCCESS)
+	s = open_target();
+	if (!s) {
+		job_free(&job);
 		return EXIT_FAILURE;
+	}
+
+	ret = profile_bench(s, &job, &best);
+	if (ret == EXIT_SUCCESS)
+		ret = profile_save(&best, bench_path);
+
+	job_free(&job);
+
+	close_target(s);
+
+	return ret == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static struct fine_session *check_session(bool realtime)
+{
+	struct fine_session *s = fine_session_new(sim_new());
+
+	if (!s)
+		return NULL;
+
+	sim_set_model(fine_get_transport(s), &model, realtime);
+	sim_set_stub(fine_get_transport(s), sim_stub);
+	if (have_profile)
+		fine_set_profile(s, &profile);
+
+	return s;
+}
+
+/* Run the job twice on the simulator: on the virtual clock for the
+ * prediction, then sleeping each exchange's modelled time, and compare
+ * the totals. The gap is the host overhead the model leaves out.
+ */
+static int check_job(const char *path)
+{
+	uint64_t cost[MODEL_NUM_COSTS];
+	uint64_t predicted = 0, measured, start;
+	struct fine_session *s;
+	struct job job;
+	double off;
+	int ret;
 
-	ret = fine_get_serial_protect_state();
+	ret = job_load(&job, path, cache_dir);
 	if (ret != EXIT_SUCCESS)
 		return EXIT_FAILURE;
 
-	ret = fine_check_id_code(id_code);
-	if (ret != EXIT_SUCCESS)
+	s = check_session(false);
+	if (!s) {
+		job_free(&job);
 		return EXIT_FAILURE;
+	}
 
-	ret = fine_get_device_mem_info();
+	ret = job_run(&job, s);
+	sim_get_costs(fine_get_transport(s), cost);
+	fine_session_free(s);
 	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	for (int i = 0; i < MODEL_NUM_COSTS; i++)
+		predicted += cost[i];
+
+	job_reset(&job);
+
+	s = check_session(true);
+	if (!s) {
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	start = fine_now_ns(s);
+	ret = job_run(&job, s);
+	measured = fine_now_ns(s) - start;
+	fine_session_free(s);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	off = predicted ? 100.0 * ((double)measured - predicted) / predicted : 0.0;
+
+	printf("Model check: predicted %.3f ms, simulated %.3f ms (%+.1f%%)\n",
+	       predicted / 1e6, measured / 1e6, off);
+
+	if (off > (double)check_percent || off < -(double)check_percent) {
+		LOG_ERROR("Simulated time is more than %lu%% off the prediction",
+			  check_percent);
+		ret = EXIT_FAILURE;
+	}
+
+out:
+	job_free(&job);
+
+	return ret == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+	struct fine_device_type dt;
+	struct fine_frequency freq;
+	struct fine_auth_mode auth;
+	struct fine_mem_info mem;
+	struct fine_session *s;
+	unsigned long port;
+	char *end;
+	int ret;
+	int c;
+
+	log_init();
+	atexit(log_exit);
+
+	model_init(&model);
+	profile_init(&profile);
+
+	while ((c = getopt_long(argc, argv, "snh", long_options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			use_sim = true;
+			break;
+		case 'p':
+			use_sim = true;
+			if (sscanf(optarg, "%" SCNu32 ":%" SCNu32, &sim_absent_ms,
+				   &sim_present_ms) != 2 || !sim_present_ms) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'T':
+			use_sim = true;
+			sim_stub = true;
+			break;
+		case 'S':
+			station = true;
+			station_boards = optarg ? atoi(optarg) : 0;
+			break;
+		case 'm':
+			metrics_set_file(optarg);
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		case 'o':
+			if (model_load(&model, optarg) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			have_model = true;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'C':
+			calibrate_path = optarg;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'R':
+			replay_path = optarg;
+			break;
+		case 'F':
+			replay_fast = true;
+			break;
+		case 'P':
+			compile_path = optarg;
+			break;
+		case 'f':
+			if (profile_load(&profile, optarg) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			have_profile = true;
+			break;
+		case 'b':
+			bench_path = optarg;
+			break;
+		case 'K':
+			check_percent = 5;
+			if (optarg) {
+				check_percent = strtoul(optarg, &end, 10);
+				if (!*optarg || *end || !check_percent || check_percent > 100) {
+					LOG_ERROR("Invalid model check tolerance '%s'", optarg);
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		case 'M':
+			port = strtoul(optarg, &end, 10);
+			if (!*optarg || *end || !port || port > UINT16_MAX) {
+				LOG_ERROR("Invalid metrics port '%s'", optarg);
+				return EXIT_FAILURE;
+			}
+			if (metrics_serve(port) != EXIT_SUCCESS)
+				return EXIT_FAILURE;
+			atexit(metrics_stop);
+			break;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind > 1 || ((station || dry_run) && optind == argc) ||
+	    (dry_run && (station || calibrate_path || record_path)) ||
+	    (replay_path && (use_sim || dry_run)) || (replay_fast && !replay_path) ||
+	    (compile_path && (optind == argc || station || dry_run || replay_path ||
+			      record_path || calibrate_path)) ||
+	    (bench_path && (optind == argc || station || compile_path || replay_path)) ||
+	    (check_percent && (optind == argc || station || dry_run || compile_path ||
+			       bench_path || replay_path || record_path || calibrate_path))) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (compile_path)
+		return compile_job(argv[optind]);
+
+	if (bench_path)
+		return bench_job(argv[optind]);
+
+	if (check_percent)
+		return check_job(argv[optind]);
+
+	if (optind < argc)
+		return run_job(argv[optind]);
+
+	s = open_target();
+	if (!s)
 		return EXIT_FAILURE;
 
-	jaylink_close(devh);
-	jaylink_exit(ctx);
+	ret = fine_get_chip_id(s);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_init_chip(s);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_get_device_type(s, &dt);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	printf("max_input_clk_freq = %" PRIu32 "\n", dt.max_input_clk);
+	printf("min_input_clk_freq = %" PRIu32 "\n", dt.min_input_clk);
+	printf("max_sys_clk_freq   = %" PRIu32 "\n", dt.max_sys_clk);
+	printf("min_sys_clk_freq   = %" PRIu32 "\n", dt.min_sys_clk);
+
+	ret = fine_set_endianness(s, TARGET_LITTLE_ENDIAN);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_set_frequency(s, 16, 120, &freq);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	printf("System frequency set to     %" PRIu32 "\n", freq.sys_clk);
+	printf("Peripheral frequency set to %" PRIu32 "\n", freq.periph_clk);
+
+	ret = fine_set_bitrate(s, 1000000);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_send_sync(s);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_get_serial_protect_state(s, &auth);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	printf("Serial boot allowed = %d\n", auth.serial_boot_allowed);
+
+	ret = fine_check_id_code(s, id_code);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	ret = fine_get_device_mem_info(s, &mem);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	for (int i = 0; i < mem.area_count; i++) {
+		printf("area[%d].koa = %x\n", i, mem.area[i].koa);
+		printf("area[%d].sad = %" PRIx32 "\n", i, mem.area[i].sad);
+		printf("area[%d].ead = %" PRIx32 "\n", i, mem.area[i].ead);
+		printf("area[%d].eau = %" PRIx32 "\n", i, mem.area[i].eau);
+		printf("area[%d].wau = %" PRIx32 "\n", i, mem.area[i].wau);
+	}
+
+out:
+	close_target(s);
 
-	return 0;
-}
\ No newline at end of file
+	return ret == EXIT_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
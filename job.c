@@ -0,0 +1,913 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A job file describes the whole per-board sequence, one step per line:
+ *
+ *   connect
+ *   id_code  332211FFFFFFFFFFFFFFFFFFFFFFFFFF
+ *   endian   little
+ *   frequency 16 120
+ *   bitrate  1000000
+ *   sync
+ *   erase    0xFFF00000 0xFFFFFFFF
+ *   program  firmware.mot
+ *   program  data.bin 0x00100000
+ *   option   0xFE7F5D00 FFFFFFFF
+ *   verify
+ *   read     0x00100000 0x8000 dump.bin
+ *   patch    0xFFFFFF00 4 counter 1000
+ *   patch    0x00100010 6 file macs.txt
+ *   stub     flashstub.bin 0x00000800
+ *
+ * A patch step declares a region of the image programmed by an earlier
+ * step that takes a new value on every run: a little endian counter or
+ * the next line of a file of hex values. Only the packets holding the
+ * region are re-framed for each unit.
+ *
+ * A stub step loads a flash programming stub into RAM and starts it;
+ * later program and option steps then stream compressed blocks to it.
+ * Targets that can't take a stub keep using plain boot mode writes.
+ *
+ * The whole file is parsed, checked and turned into command payloads and
+ * prepared images (see prep.c) before the probe is touched, so running a
+ * job is only FINE traffic.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "fine.h"
+#include "sink.h"
+#include "image.h"
+#include "job.h"
+#include "plan.h"
+
+static const char * const step_names[] = {
+	[JOB_CONNECT]	= "connect",
+	[JOB_ID_CODE]	= "id_code",
+	[JOB_ENDIAN]	= "endian",
+	[JOB_FREQUENCY]	= "frequency",
+	[JOB_BITRATE]	= "bitrate",
+	[JOB_SYNC]	= "sync",
+	[JOB_ERASE]	= "erase",
+	[JOB_PROGRAM]	= "program",
+	[JOB_OPTION]	= "option",
+	[JOB_VERIFY]	= "verify",
+	[JOB_READ]	= "read",
+	[JOB_PATCH]	= "patch",
+	[JOB_STUB]	= "stub",
+};
+
+static int parse_u32(const char *s, uint32_t *val)
+{
+	char *end;
+	unsigned long v;
+
+	/* strtoul() takes "-1" as ULONG_MAX */
+	if (!s || *s == '-')
+		return EXIT_FAILURE;
+
+	v = strtoul(s, &end, 0);
+	if (*end || end == s || v > UINT32_MAX)
+		return EXIT_FAILURE;
+
+	*val = v;
+
+	return EXIT_SUCCESS;
+}
+
+static int parse_u64(const char *s, uint64_t *val)
+{
+	char *end;
+	unsigned long long v;
+
+	if (!s || *s == '-')
+		return EXIT_FAILURE;
+
+	errno = 0;
+	v = strtoull(s, &end, 0);
+	if (*end || end == s || errno == ERANGE)
+		return EXIT_FAILURE;
+
+	*val = v;
+
+	return EXIT_SUCCESS;
+}
+
+static int parse_hex(const char *s, uint8_t *buf, int max)
+{
+	int len = 0;
+
+	if (!s || strlen(s) % 2)
+		return -1;
+
+	for (; *s; s += 2) {
+		char tmp[3] = { s[0], s[1], 0 };
+		char *end;
+
+		if (len == max)
+			return -1;
+		buf[len++] = strtoul(tmp, &end, 16);
+		if (*end)
+			return -1;
+	}
+
+	return len;
+}
+
+static int job_load_values(struct job_patch *patch, const char *path)
+{
+	char line[512];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		LOG_ERROR("Can't open %s", path);
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		uint8_t *values;
+		char *tok;
+
+		tok = strchr(line, '#');
+		if (tok)
+			*tok = '\0';
+
+		tok = strtok(line, " \t\r\n");
+		if (!tok)
+			continue;
+
+		values = realloc(patch->values, (patch->num_values + 1) * patch->len);
+		if (!values)
+			goto err;
+		patch->values = values;
+
+		if (parse_hex(tok, &values[patch->num_values * patch->len],
+			      patch->len) != (int)patch->len) {
+			LOG_ERROR("%s: '%s' is not a %" PRIu32 " byte value", path,
+				  tok, patch->len);
+			goto err;
+		}
+
+		patch->num_values++;
+	}
+
+	fclose(f);
+
+	if (!patch->num_values) {
+		LOG_ERROR("%s: no values", path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+
+err:
+	fclose(f);
+	return EXIT_FAILURE;
+}
+
+/* The region must lie in the image of the latest step writing there */
+static int job_parse_patch(struct job *job, struct job_step *step, char **argv,
+			   int argc)
+{
+	struct job_patch *patch;
+
+	patch = calloc(1, sizeof(*patch));
+	if (!patch)
+		return EXIT_FAILURE;
+	step->patch = patch;
+
+	if (argc < 5 || parse_u32(argv[1], &patch->addr) ||
+	    parse_u32(argv[2], &patch->len) || !patch->len || patch->len > 256)
+		return EXIT_FAILURE;
+
+	if (!strcmp(argv[3], "counter")) {
+		patch->counter_step = 1;
+
+		if (argc > 6 || patch->len > 8 || parse_u64(argv[4], &patch->counter) ||
+		    (argc == 6 && parse_u64(argv[5], &patch->counter_step)))
+			return EXIT_FAILURE;
+	} else if (!strcmp(argv[3], "file")) {
+		if (argc != 5 || job_load_values(patch, argv[4]))
+			return EXIT_FAILURE;
+	} else {
+		return EXIT_FAILURE;
+	}
+
+	for (patch->step = step - job->steps - 1; patch->step >= 0; patch->step--) {
+		struct job_step *prog = &job->steps[patch->step];
+
+		if (prog->type != JOB_PROGRAM && prog->type != JOB_OPTION)
+			continue;
+
+		patch->index = prep_add_patch(&prog->prep, patch->addr, patch->len);
+		if (patch->index >= 0)
+			return EXIT_SUCCESS;
+	}
+
+	LOG_ERROR("%s:%d: 0x%08" PRIx32 "+%" PRIu32 " is not within the data of"
+		  " an earlier program step, or overlaps another patch",
+		  job->path, step->line, patch->addr, patch->len);
+
+	return EXIT_FAILURE;
+}
+
+/* The stub is one contiguous range, started at its first byte */
+static int job_parse_stub(struct job_step *step, char **argv, int argc)
+{
+	struct image image;
+	uint32_t addr;
+	int ret;
+
+	if (argc < 2 || argc > 3 || (argc == 3 && parse_u32(argv[2], &addr)))
+		return EXIT_FAILURE;
+
+	step->arg = strdup(argv[1]);
+
+	if (image_load(&image, argv[1], argc == 3 ? &addr : NULL))
+		return EXIT_FAILURE;
+
+	if (image.num_sections != 1 || !image.sections[0].size) {
+		LOG_ERROR("%s: a stub must be one contiguous range", argv[1]);
+		image_free(&image);
+		return EXIT_FAILURE;
+	}
+
+	ret = prep_build_raw(&step->prep, image.sections[0].addr,
+			     image.sections[0].data, image.sections[0].size);
+	image_free(&image);
+
+	return ret;
+}
+
+static int job_parse_step(struct job *job, struct job_step *step, char **argv,
+			  int argc)
+{
+	uint32_t a, b;
+	int len;
+
+	switch (step->type) {
+	case JOB_CONNECT:
+	case JOB_SYNC:
+	case JOB_VERIFY:
+		return argc == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	case JOB_ID_CODE:
+		if (argc != 2 || parse_hex(argv[1], step->req, 16) != 16)
+			return EXIT_FAILURE;
+		step->req_len = 16;
+		return EXIT_SUCCESS;
+
+	case JOB_ENDIAN:
+		if (argc != 2)
+			return EXIT_FAILURE;
+		if (!strcmp(argv[1], "little"))
+			step->req[0] = 1;
+		else if (!strcmp(argv[1], "big"))
+			step->req[0] = 0;
+		else
+			return EXIT_FAILURE;
+		step->req_len = 1;
+		return EXIT_SUCCESS;
+
+	case JOB_FREQUENCY:
+		/* sent in Hz */
+		if (argc != 3 || parse_u32(argv[1], &a) || parse_u32(argv[2], &b) ||
+		    a > UINT32_MAX / 1000000 || b > UINT32_MAX / 1000000)
+			return EXIT_FAILURE;
+		buf_set_u32_be(step->req, 0, a * 1000000);
+		buf_set_u32_be(step->req, 4, b * 1000000);
+		step->req_len = 8;
+		return EXIT_SUCCESS;
+
+	case JOB_BITRATE:
+		if (argc != 2 || parse_u32(argv[1], &a) || !a)
+			return EXIT_FAILURE;
+		buf_set_u32_be(step->req, 0, a);
+		step->req_len = 4;
+		return EXIT_SUCCESS;
+
+	case JOB_ERASE:
+		/* the whole 4 GiB has no 32-bit length and no area holds it */
+		if (argc != 3 || parse_u32(argv[1], &a) || parse_u32(argv[2], &b) ||
+		    a > b || (!a && b == UINT32_MAX))
+			return EXIT_FAILURE;
+		buf_set_u32_be(step->req, 0, a);
+		buf_set_u32_be(step->req, 4, b);
+		step->req_len = 8;
+		return EXIT_SUCCESS;
+
+	case JOB_READ:
+		if (argc != 4 || parse_u32(argv[1], &a) || parse_u32(argv[2], &b) ||
+		    !b || a + (b - 1) < a)
+			return EXIT_FAILURE;
+		buf_set_u32_be(step->req, 0, a);
+		buf_set_u32_be(step->req, 4, b);
+		step->req_len = 8;
+		step->arg = strdup(argv[3]);
+		return step->arg ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	case JOB_PATCH:
+		return job_parse_patch(job, step, argv, argc);
+
+	case JOB_STUB:
+		return job_parse_stub(step, argv, argc);
+
+	case JOB_PROGRAM:
+		if (argc < 2 || argc > 3 || (argc == 3 && parse_u32(argv[2], &a)))
+			return EXIT_FAILURE;
+
+		step->arg = strdup(argv[1]);
+
+		return prep_load(&step->prep, argv[1], argc == 3 ? &a : NULL,
+				 job->cache_dir);
+
+	case JOB_OPTION: {
+		uint8_t *data;
+		int ret;
+
+		if (argc != 3 || parse_u32(argv[1], &a))
+			return EXIT_FAILURE;
+		data = malloc(strlen(argv[2]) / 2 + 1);
+		if (!data)
+			return EXIT_FAILURE;
+		len = parse_hex(argv[2], data, strlen(argv[2]) / 2);
+		ret = len > 0 ? prep_build_raw(&step->prep, a, data, len) : EXIT_FAILURE;
+		free(data);
+		return ret;
+	}
+	}
+
+	return EXIT_FAILURE;
+}
+
+/* Ordering rules the target enforces anyway, caught before running */
+static int job_check_order(struct job *job)
+{
+	bool connected = false;
+	bool frequency = false;
+	bool written = false;
+
+	for (int i = 0; i < job->num_steps; i++) {
+		struct job_step *step = &job->steps[i];
+
+		if (step->type != JOB_CONNECT && !connected) {
+			LOG_ERROR("%s:%d: '%s' before connect", job->path,
+				  step->line, step_names[step->type]);
+			return EXIT_FAILURE;
+		}
+
+		switch (step->type) {
+		case JOB_CONNECT:
+			if (connected) {
+				LOG_ERROR("%s:%d: duplicate connect", job->path, step->line);
+				return EXIT_FAILURE;
+			}
+			connected = true;
+			break;
+		case JOB_FREQUENCY:
+			frequency = true;
+			break;
+		case JOB_BITRATE:
+			if (!frequency) {
+				LOG_ERROR("%s:%d: bitrate needs a frequency step first",
+					  job->path, step->line);
+				return EXIT_FAILURE;
+			}
+			break;
+		case JOB_PROGRAM:
+		case JOB_OPTION:
+			written = true;
+			break;
+		case JOB_VERIFY:
+			if (!written) {
+				LOG_ERROR("%s:%d: nothing to verify", job->path, step->line);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int job_load(struct job *job, const char *path, const char *cache_dir)
+{
+	char line[512];
+	int lineno = 0;
+	FILE *f;
+
+	if (plan_is_plan(path))
+		return plan_load(job, path);
+
+	memset(job, 0, sizeof(*job));
+	job->path = path;
+	job->cache_dir = cache_dir;
+
+	f = fopen(path, "r");
+	if (!f) {
+		LOG_ERROR("Can't open job file %s", path);
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		struct job_step *step;
+		char *argv[8];
+		int argc = 0;
+		char *tok;
+		size_t type;
+
+		lineno++;
+
+		tok = strchr(line, '#');
+		if (tok)
+			*tok = '\0';
+
+		for (tok = strtok(line, " \t\r\n"); tok && argc < 8;
+		     tok = strtok(NULL, " \t\r\n"))
+			argv[argc++] = tok;
+
+		if (!argc)
+			continue;
+
+		for (type = 0; type < sizeof(step_names) / sizeof(step_names[0]); type++) {
+			if (!strcmp(argv[0], step_names[type]))
+				break;
+		}
+
+		if (type == sizeof(step_names) / sizeof(step_names[0])) {
+			LOG_ERROR("%s:%d: unknown step '%s'", path, lineno, argv[0]);
+			goto err;
+		}
+
+		step = realloc(job->steps, (job->num_steps + 1) * sizeof(*step));
+		if (!step)
+			goto err;
+		job->steps = step;
+		step = &job->steps[job->num_steps++];
+		memset(step, 0, sizeof(*step));
+		step->type = type;
+		step->line = lineno;
+
+		if (job_parse_step(job, step, argv, argc)) {
+			LOG_ERROR("%s:%d: invalid '%s' step", path, lineno, argv[0]);
+			goto err;
+		}
+	}
+
+	fclose(f);
+
+	if (!job->num_steps) {
+		LOG_ERROR("%s: empty job", path);
+		job_free(job);
+		return EXIT_FAILURE;
+	}
+
+	if (job_check_order(job)) {
+		job_free(job);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+
+err:
+	fclose(f);
+	job_free(job);
+	return EXIT_FAILURE;
+}
+
+void job_free(struct job *job)
+{
+	for (int i = 0; i < job->num_steps; i++) {
+		prep_free(&job->steps[i].prep);
+		free(job->steps[i].arg);
+		if (job->steps[i].patch)
+			free(job->steps[i].patch->values);
+		free(job->steps[i].patch);
+	}
+
+	free(job->steps);
+	job->steps = NULL;
+	job->num_steps = 0;
+
+	if (job->plan_map)
+		munmap(job->plan_map, job->plan_map_len);
+	job->plan_map = NULL;
+}
+
+static const struct fine_area_info *job_find_area(struct job *job,
+						  struct fine_session *s,
+						  uint32_t addr, uint32_t len)
+{
+	if (!job->have_mem_info) {
+		if (fine_get_device_mem_info(s, &job->mem) != EXIT_SUCCESS)
+			return NULL;
+		job->have_mem_info = true;
+	}
+
+	for (int i = 0; i < job->mem.area_count; i++) {
+		const struct fine_area_info *area = &job->mem.area[i];
+
+		if (addr >= area->sad && addr + (len - 1) <= area->ead &&
+		    addr + (len - 1) >= addr)
+			return area;
+	}
+
+	LOG_TAG_ERROR(fine_get_tag(s),
+		      "Range 0x%08" PRIx32 "+0x%" PRIx32 " is outside device areas",
+		      addr, len);
+
+	return NULL;
+}
+
+/* Send a block, the patched packets from their segments */
+static int job_write_block(struct fine_session *s, const struct prep_image *prep,
+			   uint32_t block)
+{
+	const struct prep_block *blk = &prep->blocks[block];
+	uint32_t off = blk->frame_off;
+	int ret;
+
+	ret = fine_write_begin(s, blk->addr, blk->len);
+
+	for (uint32_t i = 0; i < prep->num_segments && ret == EXIT_SUCCESS; i++) {
+		const struct prep_segment *seg = &prep->segments[i];
+
+		if (seg->block != block)
+			continue;
+
+		ret = fine_write_packets(s, &prep->frames[off], seg->frame_off - off);
+		if (ret == EXIT_SUCCESS)
+			ret = fine_write_packets(s, seg->frames, seg->frame_len);
+		off = seg->frame_off + seg->frame_len;
+	}
+
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	return fine_write_packets(s, &prep->frames[off],
+				  blk->frame_off + blk->frame_len - off);
+}
+
+/* Through the stub, one stub block at a time with the patches applied */
+static int job_stub_write_block(struct fine_session *s, const struct prep_image *prep,
+				uint32_t block)
+{
+	const struct prep_block *blk = &prep->blocks[block];
+	uint8_t *buf = malloc(FINE_STUB_BLOCK);
+	int ret = EXIT_SUCCESS;
+
+	if (!buf)
+		return EXIT_FAILURE;
+
+	for (uint32_t off = 0; off < blk->len && ret == EXIT_SUCCESS; off += FINE_STUB_BLOCK) {
+		uint32_t n = blk->len - off;
+
+		if (n > FINE_STUB_BLOCK)
+			n = FINE_STUB_BLOCK;
+
+		prep_copy_data(prep, block, off, buf, n);
+		ret = fine_stub_write(s, blk->addr + off, buf, n);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+static int job_stub_start(struct job *job, struct fine_session *s,
+			  struct job_step *step)
+{
+	const struct prep_block *blk = &step->prep.blocks[0];
+	int ret;
+
+	ret = fine_stub_start(s, blk->addr, step->prep.data, blk->len);
+	if (ret == FINE_CMD_ERR_NOT_SUPPORTED) {
+		LOG_TAG_WARNING(fine_get_tag(s),
+				"%s:%d: target can't run a stub, using boot mode writes",
+				job->path, step->line);
+		return EXIT_SUCCESS;
+	}
+
+	if (ret == EXIT_SUCCESS)
+		job->stub = true;
+
+	return ret;
+}
+
+static int job_write_blocks(struct job *job, struct fine_session *s,
+			    struct job_step *step)
+{
+	const struct prep_image *prep = &step->prep;
+
+	for (uint32_t i = 0; i < prep->num_blocks; i++) {
+		const struct prep_block *blk = &prep->blocks[i];
+		const struct fine_area_info *area = job_find_area(job, s, blk->addr, blk->len);
+		int ret;
+
+		if (!area)
+			return EXIT_FAILURE;
+
+		if (!job->first_write_ns)
+			job->first_write_ns = fine_now_ns(s);
+
+		if (area->wau && ((blk->addr % area->wau) || (blk->len % area->wau))) {
+			LOG_TAG_ERROR(fine_get_tag(s), "%s:%d: 0x%08" PRIx32 "+0x%" PRIx32
+				      " not aligned to write unit 0x%" PRIx32,
+				      job->path, step->line, blk->addr, blk->len, area->wau);
+			return EXIT_FAILURE;
+		}
+
+		if (job->stub)
+			ret = job_stub_write_block(s, prep, i);
+		else
+			ret = job_write_block(s, prep, i);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Read back every programmed block, hashing it on the fly against the
+ * checksum computed when the image was prepared.
+ */
+static int job_verify(struct job *job, struct fine_session *s,
+		      struct job_step *verify)
+{
+	struct fine_sink_sum sum;
+	int ret = EXIT_SUCCESS;
+
+	for (struct job_step *step = job->steps; step < verify && !ret; step++) {
+		if (step->type != JOB_PROGRAM && step->type != JOB_OPTION)
+			continue;
+
+		for (uint32_t i = 0; i < step->prep.num_blocks && !ret; i++) {
+			const struct prep_block *blk = &step->prep.blocks[i];
+
+			fine_sink_sum_init(&sum);
+
+			ret = fine_read_sink(s, blk->addr, blk->len, &sum.sink);
+			if (ret != EXIT_SUCCESS)
+				break;
+
+			if (sum.len != blk->len ||
+			    (uint32_t)sum.hash != prep_block_checksum(&step->prep, i)) {
+				LOG_TAG_ERROR(fine_get_tag(s), "Verify failed in block 0x%08" PRIx32, blk->addr);
+				ret = EXIT_FAILURE;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/* Memory goes straight from the exchange buffers to the file */
+static int job_read(struct job *job, struct fine_session *s,
+		    struct job_step *step)
+{
+	uint32_t addr = buf_get_u32_be(step->req, 0);
+	uint32_t len = buf_get_u32_be(step->req, 4);
+	struct fine_sink_fd out;
+	int ret;
+	int fd;
+
+	fd = open(step->arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_TAG_ERROR(fine_get_tag(s), "%s:%d: can't create %s: %s",
+			      job->path, step->line, step->arg, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	fine_sink_fd_init(&out, fd);
+	ret = fine_read_sink(s, addr, len, &out.sink);
+
+	if (close(fd) && ret == EXIT_SUCCESS) {
+		LOG_TAG_ERROR(fine_get_tag(s), "%s:%d: can't write %s: %s",
+			      job->path, step->line, step->arg, strerror(errno));
+		ret = EXIT_FAILURE;
+	}
+
+	return ret;
+}
+
+/* Give every patch region its value for the board about to be run */
+static int job_next_unit(struct job *job)
+{
+	for (int i = 0; i < job->num_steps; i++) {
+		struct job_patch *patch = job->steps[i].patch;
+		uint8_t value[8];
+
+		if (!patch)
+			continue;
+
+		if (patch->values) {
+			if (patch->next_value == patch->num_values) {
+				LOG_ERROR("%s:%d: no patch values left", job->path,
+					  job->steps[i].line);
+				return EXIT_FAILURE;
+			}
+			prep_set_patch(&job->steps[patch->step].prep, patch->index,
+				       &patch->values[patch->next_value++ * patch->len]);
+		} else {
+			for (uint32_t b = 0; b < patch->len; b++)
+				value[b] = patch->counter >> (8 * b);
+			prep_set_patch(&job->steps[patch->step].prep, patch->index, value);
+			patch->counter += patch->counter_step;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int job_log_patch(const struct job_patch *patch, const struct prep_image *prep)
+{
+	const uint8_t *value = prep->patches[patch->index].value;
+	char hex[2 * 256 + 1];
+
+	for (uint32_t i = 0; i < patch->len; i++)
+		sprintf(&hex[2 * i], "%02X", value[i]);
+
+	printf("Patched 0x%08" PRIx32 ": %s\n", patch->addr, hex);
+
+	return EXIT_SUCCESS;
+}
+
+static int job_run_step(struct job *job, struct fine_session *s,
+			struct job_step *step)
+{
+	struct fine_device_type dt;
+	struct fine_frequency freq;
+	const struct fine_area_info *area;
+	uint32_t sad, ead;
+	int ret;
+
+	if (job->plan_map && step->type != JOB_CONNECT)
+		return plan_exec(s, step->plan, step->plan_len);
+
+	switch (step->type) {
+	case JOB_CONNECT:
+		ret = fine_get_chip_id(s);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		ret = fine_init_chip(s);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		ret = fine_get_device_type(s, &dt);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		printf("Device type %.8s\n", (const char *)dt.type);
+		return EXIT_SUCCESS;
+
+	case JOB_FREQUENCY:
+		ret = fine_exec(s, FINE_CMD_SET_FREQUENCY, step->req, step->req_len, &freq);
+		if (ret != EXIT_SUCCESS)
+			return ret;
+		printf("System frequency set to     %" PRIu32 "\n", freq.sys_clk);
+		printf("Peripheral frequency set to %" PRIu32 "\n", freq.periph_clk);
+		return EXIT_SUCCESS;
+
+	case JOB_ID_CODE:
+		return fine_exec(s, FINE_CMD_CHECK_ID_CODE, step->req, step->req_len, NULL);
+	case JOB_ENDIAN:
+		return fine_exec(s, FINE_CMD_SET_ENDIANNSESS, step->req, step->req_len, NULL);
+	case JOB_BITRATE:
+		return fine_exec(s, FINE_CMD_SET_BITRATE, step->req, step->req_len, NULL);
+	case JOB_SYNC:
+		return fine_exec(s, FINE_CMD_SYNC, NULL, 0, NULL);
+
+	case JOB_ERASE:
+		sad = buf_get_u32_be(step->req, 0);
+		ead = buf_get_u32_be(step->req, 4);
+		area = job_find_area(job, s, sad, ead - sad + 1);
+		if (!area)
+			return EXIT_FAILURE;
+		if (area->eau && ((sad - area->sad) % area->eau ||
+				  (ead - area->sad + 1) % area->eau)) {
+			LOG_TAG_ERROR(fine_get_tag(s),
+				      "%s:%d: erase range not aligned to erase unit 0x%" PRIx32,
+				      job->path, step->line, area->eau);
+			return EXIT_FAILURE;
+		}
+		return fine_exec(s, FINE_CMD_ERASE, step->req, step->req_len, NULL);
+
+	case JOB_PROGRAM:
+	case JOB_OPTION:
+		return job_write_blocks(job, s, step);
+
+	case JOB_VERIFY:
+		return job_verify(job, s, step);
+
+	case JOB_READ:
+		return job_read(job, s, step);
+
+	case JOB_STUB:
+		return job_stub_start(job, s, step);
+
+	case JOB_PATCH:
+		return job_log_patch(step->patch, &job->steps[step->patch->step].prep);
+	}
+
+	return EXIT_FAILURE;
+}
+
+void job_reset(struct job *job)
+{
+	for (int i = 0; i < job->num_steps; i++) {
+		job->steps[i].elapsed_ns = 0;
+		job->steps[i].done = false;
+	}
+
+	/* Next board may be a different part */
+	job->have_mem_info = false;
+	job->start_ns = 0;
+	job->first_write_ns = 0;
+	job->stub = false;
+}
+
+/* Run steps [first, first + count) of the current unit */
+int job_run_steps(struct job *job, struct fine_session *s, int first, int count)
+{
+	for (int i = first; i < first + count && i < job->num_steps; i++) {
+		struct job_step *step = &job->steps[i];
+		uint64_t start = fine_now_ns(s);
+		int ret;
+
+		LOG_TAG_DEBUG(fine_get_tag(s), "%s:%d: %s", job->path, step->line, step_names[step->type]);
+
+		ret = job_run_step(job, s, step);
+		step->elapsed_ns = fine_now_ns(s) - start;
+
+		if (ret != EXIT_SUCCESS) {
+			LOG_TAG_ERROR(fine_get_tag(s), "%s:%d: step '%s' failed",
+				      job->path, step->line, step_names[step->type]);
+			return ret;
+		}
+
+		step->done = true;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int job_run(struct job *job, struct fine_session *s)
+{
+	job->start_ns = fine_now_ns(s);
+
+	if (job_next_unit(job) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+
+	return job_run_steps(job, s, 0, job->num_steps);
+}
+
+void job_report(const struct job *job)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < job->num_steps; i++)
+		total += job->steps[i].elapsed_ns;
+
+	printf("%-4s %-10s %12s %6s\n", "line", "step", "time (ms)", "%");
+
+	for (int i = 0; i < job->num_steps; i++) {
+		const struct job_step *step = &job->steps[i];
+
+		if (!step->done && !step->elapsed_ns)
+			continue;
+
+		printf("%-4d %-10s %12.3f %5.1f%s\n", step->line,
+			step_names[step->type], step->elapsed_ns / 1e6,
+			total ? 100.0 * step->elapsed_ns / total : 0.0,
+			step->done ? "" : "  FAILED");
+	}
+
+	printf("%-4s %-10s %12.3f\n", "", "total", total / 1e6);
+}
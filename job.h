@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOB_H
+#define JOB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "prep.h"
+
+struct fine_session;
+
+enum job_step_type {
+	JOB_CONNECT,
+	JOB_ID_CODE,
+	JOB_ENDIAN,
+	JOB_FREQUENCY,
+	JOB_BITRATE,
+	JOB_SYNC,
+	JOB_ERASE,
+	JOB_PROGRAM,
+	JOB_OPTION,
+	JOB_VERIFY,
+	JOB_READ,
+	JOB_PATCH,
+	JOB_STUB,
+};
+
+#define JOB_NUM_TYPES			(JOB_STUB + 1)
+
+/* Per-unit value of a patch step, from a counter or a list of values */
+struct job_patch {
+	int step;			/* program or option step patched */
+	int index;			/* patch in its prepared image */
+	uint32_t addr;
+	uint32_t len;
+	uint64_t counter;
+	uint64_t counter_step;
+	uint8_t *values;		/* len bytes each, NULL for a counter */
+	uint32_t num_values;
+	uint32_t next_value;
+};
+
+struct job_step {
+	enum job_step_type type;
+	int line;
+	char *arg;			/* file name, for reporting */
+	uint8_t req[16];		/* precomputed command payload */
+	uint16_t req_len;
+	struct prep_image prep;		/* program, option and stub data */
+	struct job_patch *patch;	/* patch steps */
+	const uint8_t *plan;		/* compiled exchanges, see plan.h */
+	uint32_t plan_len;
+	uint64_t elapsed_ns;
+	bool done;
+};
+
+struct job {
+	const char *path;
+	const char *cache_dir;		/* prepared image cache, may be NULL */
+	int num_steps;
+	struct job_step *steps;
+	bool have_mem_info;
+	struct fine_mem_info mem;
+	uint64_t start_ns;
+	uint64_t first_write_ns;	/* first write command sent */
+	bool stub;			/* flash stub running on the board */
+	void *plan_map;			/* mapped plan file, if loaded from one */
+	size_t plan_map_len;
+};
+
+int job_load(struct job *job, const char *path, const char *cache_dir);
+void job_reset(struct job *job);
+int job_run(struct job *job, struct fine_session *s);
+int job_run_steps(struct job *job, struct fine_session *s, int first, int count);
+void job_report(const struct job *job);
+void job_free(struct job *job);
+
+#endif /* JOB_H */
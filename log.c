@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Log records are formatted by the caller straight into a slot of a
+ * bounded multi-producer ring (sequence number per slot, no locks) and
+ * written to stdout by a background thread. Nothing is allocated once
+ * log_init() has returned. When the ring is full the record is dropped
+ * and counted rather than blocking the FINE I/O path. Before log_init()
+ * or after log_exit() records are written synchronously.
+ */
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "log.h"
+
+struct log_record {
+	atomic_size_t seq;
+	enum log_levels level;
+	char tag[LOG_TAG_MAX];
+	char msg[LOG_LINE_MAX];
+};
+
+static struct log_record ring[LOG_RING_SIZE];
+static atomic_size_t ring_head;		/* next slot to fill */
+static size_t ring_tail;		/* next slot to drain, consumer only */
+
+static atomic_bool running;
+static atomic_bool stopping;
+static atomic_ulong dropped;
+static pthread_t drain_thread;
+
+static atomic_int threshold = LOG_LVL_INFO;
+
+static const char * const level_prefix[] = {
+	[LOG_LVL_ERROR]   = "Error: ",
+	[LOG_LVL_WARNING] = "Warn : ",
+	[LOG_LVL_INFO]    = "",
+	[LOG_LVL_DEBUG]   = "Debug: ",
+};
+
+static void log_write(const struct log_record *rec)
+{
+	if (rec->tag[0])
+		printf("[%s] %s%s\n", rec->tag, level_prefix[rec->level], rec->msg);
+	else
+		printf("%s%s\n", level_prefix[rec->level], rec->msg);
+}
+
+static bool log_drain_one(void)
+{
+	struct log_record *rec = &ring[ring_tail & (LOG_RING_SIZE - 1)];
+	size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+	if (seq != ring_tail + 1)
+		return false;
+
+	log_write(rec);
+
+	atomic_store_explicit(&rec->seq, ring_tail + LOG_RING_SIZE,
+			      memory_order_release);
+	ring_tail++;
+
+	return true;
+}
+
+static void *log_drain(void *arg)
+{
+	const struct timespec idle = { .tv_sec = 0, .tv_nsec = 1000000 };
+
+	(void)arg;
+
+	for (;;) {
+		bool busy = false;
+
+		while (log_drain_one())
+			busy = true;
+
+		if (busy) {
+			fflush(stdout);
+			continue;
+		}
+
+		/* A slot claimed but not yet committed is still to come */
+		if (atomic_load(&stopping) &&
+		    atomic_load_explicit(&ring_head, memory_order_acquire) == ring_tail)
+			break;
+
+		nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+void log_printf(enum log_levels level, const char *tag, const char *func,
+		const char *fmt, ...)
+{
+	struct log_record *rec;
+	struct log_record local;
+	size_t pos = 0;
+	va_list ap;
+	int len = 0;
+
+	if ((int)level > atomic_load_explicit(&threshold, memory_order_relaxed))
+		return;
+
+	if (!atomic_load_explicit(&running, memory_order_acquire)) {
+		rec = &local;
+	} else {
+		pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+		for (;;) {
+			rec = &ring[pos & (LOG_RING_SIZE - 1)];
+			size_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+
+			if (seq == pos) {
+				if (atomic_compare_exchange_weak_explicit(&ring_head,
+						&pos, pos + 1, memory_order_relaxed,
+						memory_order_relaxed))
+					break;
+			} else if (seq < pos) {
+				atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+				return;
+			} else {
+				pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+			}
+		}
+	}
+
+	rec->level = level;
+	if (tag) {
+		strncpy(rec->tag, tag, LOG_TAG_MAX - 1);
+		rec->tag[LOG_TAG_MAX - 1] = '\0';
+	} else {
+		rec->tag[0] = '\0';
+	}
+
+	if (level == LOG_LVL_DEBUG) {
+		/* A long function name leaves room for the terminator only */
+		len = snprintf(rec->msg, LOG_LINE_MAX, "%s(): ", func);
+		if (len < 0)
+			len = 0;
+		else if (len > LOG_LINE_MAX - 1)
+			len = LOG_LINE_MAX - 1;
+	}
+
+	va_start(ap, fmt);
+	vsnprintf(rec->msg + len, LOG_LINE_MAX - len, fmt, ap);
+	va_end(ap);
+
+	if (rec == &local) {
+		log_write(rec);
+		return;
+	}
+
+	atomic_store_explicit(&rec->seq, pos + 1, memory_order_release);
+}
+
+int log_init(void)
+{
+	if (atomic_load(&running))
+		return 0;
+
+	for (size_t i = 0; i < LOG_RING_SIZE; i++)
+		atomic_store(&ring[i].seq, i);
+	atomic_store(&ring_head, 0);
+	ring_tail = 0;
+	atomic_store(&stopping, false);
+
+	if (pthread_create(&drain_thread, NULL, log_drain, NULL))
+		return -1;
+
+	atomic_store_explicit(&running, true, memory_order_release);
+
+	return 0;
+}
+
+void log_exit(void)
+{
+	if (!atomic_load(&running))
+		return;
+
+	atomic_store(&stopping, true);
+	pthread_join(drain_thread, NULL);
+	atomic_store(&running, false);
+
+	/* Records claimed while the thread was stopping */
+	while (atomic_load_explicit(&ring_head, memory_order_acquire) != ring_tail) {
+		if (!log_drain_one())
+			sched_yield();
+	}
+	fflush(stdout);
+
+	if (atomic_load(&dropped))
+		fprintf(stderr, "log: %lu records dropped\n", log_dropped());
+}
+
+void log_set_level(enum log_levels level)
+{
+	atomic_store(&threshold, level);
+}
+
+unsigned long log_dropped(void)
+{
+	return atomic_load(&dropped);
+}
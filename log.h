@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+enum log_levels {
+	LOG_LVL_ERROR,
+	LOG_LVL_WARNING,
+	LOG_LVL_INFO,
+	LOG_LVL_DEBUG,
+};
+
+/* Messages above this level are removed at compile time, e.g.
+ * make CFLAGS=-DLOG_LEVEL_MAX=LOG_LVL_INFO
+ * so they carry diagnostics only: usage, reports and results are
+ * printed to stdout.
+ */
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX			LOG_LVL_DEBUG
+#endif
+
+#define LOG_LINE_MAX			160
+#define LOG_TAG_MAX			16
+#define LOG_RING_SIZE			256	/* must be a power of two */
+
+void log_printf(enum log_levels level, const char *tag, const char *func,
+		const char *fmt, ...)
+	__attribute__ ((format (printf, 4, 5)));
+
+int log_init(void);
+void log_exit(void);
+void log_set_level(enum log_levels level);
+unsigned long log_dropped(void);
+
+#define LOG_AT(level, tag, expr...) \
+	do { \
+		if ((level) <= LOG_LEVEL_MAX) \
+			log_printf(level, tag, __func__, expr); \
+	} while (0)
+
+#define LOG_ERROR(expr...)		LOG_AT(LOG_LVL_ERROR, NULL, expr)
+#define LOG_WARNING(expr...)		LOG_AT(LOG_LVL_WARNING, NULL, expr)
+#define LOG_INFO(expr...)		LOG_AT(LOG_LVL_INFO, NULL, expr)
+#define LOG_DEBUG(expr...)		LOG_AT(LOG_LVL_DEBUG, NULL, expr)
+
+/* Records of a session, prefixed with its tag, see fine_set_tag() */
+#define LOG_TAG_ERROR(tag, expr...)	LOG_AT(LOG_LVL_ERROR, tag, expr)
+#define LOG_TAG_WARNING(tag, expr...)	LOG_AT(LOG_LVL_WARNING, tag, expr)
+#define LOG_TAG_INFO(tag, expr...)	LOG_AT(LOG_LVL_INFO, tag, expr)
+#define LOG_TAG_DEBUG(tag, expr...)	LOG_AT(LOG_LVL_DEBUG, tag, expr)
+
+#endif /* LOG_H */
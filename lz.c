@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Greedy compressor with a single hash table of the last position of
+ * each 4-byte sequence: far from the best ratio, but it runs at memory
+ * speed, so blocks can be compressed as they are sent.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_HASH_BITS			12
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, uint32_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static uint8_t *lz_put_seq(uint8_t *op, const uint8_t *lit, uint32_t lit_len,
+			   uint32_t offset, uint32_t match_len)
+{
+	uint8_t *token = op++;
+	uint32_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+	*token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+
+	if (lit_len >= 15)
+		op = lz_put_len(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (!match_len)
+		return op;
+
+	*op++ = offset & 0xFF;
+	*op++ = offset >> 8;
+	if (ml >= 15)
+		op = lz_put_len(op, ml - 15);
+
+	return op;
+}
+
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	uint32_t anchor = 0;
+	uint32_t pos = 0;
+	uint8_t *op = dst;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (len >= LZ_MIN_MATCH && pos <= len - LZ_MIN_MATCH) {
+		uint32_t v = lz_read32(&src[pos]);
+		uint32_t h = lz_hash(v);
+		uint32_t cand = table[h];
+		uint32_t match = 0;
+
+		table[h] = pos;
+
+		if (cand == UINT32_MAX || pos - cand > LZ_MAX_OFFSET ||
+		    lz_read32(&src[cand]) != v) {
+			pos++;
+			continue;
+		}
+
+		match = LZ_MIN_MATCH;
+		while (pos + match < len && src[cand + match] == src[pos + match])
+			match++;
+
+		op = lz_put_seq(op, &src[anchor], pos - anchor, pos - cand, match);
+		pos += match;
+		anchor = pos;
+	}
+
+	return lz_put_seq(op, &src[anchor], len - anchor, 0, 0) - dst;
+}
+
+static int lz_get_len(const uint8_t **ip, const uint8_t *end, uint32_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip == end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+int32_t lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max)
+{
+	const uint8_t *ip = src;
+	const uint8_t *end = src + len;
+	uint32_t out = 0;
+
+	while (ip < end) {
+		uint8_t token = *ip++;
+		uint32_t lit_len = token >> 4;
+		uint32_t match_len = token & 0x0F;
+		uint32_t offset;
+
+		if (lit_len == 15 && lz_get_len(&ip, end, &lit_len))
+			return -1;
+		if (lit_len > (uint32_t)(end - ip) || lit_len > max - out)
+			return -1;
+		memcpy(&dst[out], ip, lit_len);
+		ip += lit_len;
+		out += lit_len;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (match_len == 15 && lz_get_len(&ip, end, &match_len))
+			return -1;
+		match_len += LZ_MIN_MATCH;
+
+		if (!offset || offset > out || match_len > max - out)
+			return -1;
+
+		/* Byte by byte: the match may overlap what it copies */
+		for (uint32_t i = 0; i < match_len; i++, out++)
+			dst[out] = dst[out - offset];
+	}
+
+	return out;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/* Byte-oriented LZ77 in the LZ4 block layout, small enough for the
+ * flash stub to decode in place of a word at a time. A block is a run
+ * of sequences:
+ *
+ *   token     high nibble: literal count, low nibble: match length - 4,
+ *             15 in either means more length bytes follow (each added,
+ *             255 meaning one more byte)
+ *   literals
+ *   offset    16 bits little endian, back from the current output
+ *   length bytes of the match, if any
+ *
+ * The last sequence has literals only and ends the block.
+ */
+#define LZ_MIN_MATCH			4
+#define LZ_MAX_OFFSET			65535
+
+/* Worst case compressed size of len bytes */
+#define LZ_BOUND(len)			((len) + (len) / 255 + 16)
+
+uint32_t lz_compress(const uint8_t *src, uint32_t len, uint8_t *dst);
+
+/* Returns the decompressed length, or -1 on a malformed block or one
+ * that does not fit in max bytes.
+ */
+int32_t lz_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t max);
+
+#endif /* LZ_H */
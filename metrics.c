@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Station metrics. Counters and histograms are plain arrays of atomics
+ * updated with relaxed increments; readers may see a histogram whose
+ * count is one ahead of its sum, which Prometheus tolerates.
+ *
+ * The text is either written to a file (atomically, through a rename,
+ * for the node exporter textfile collector) or served over HTTP on a
+ * localhost port for direct scraping.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "log.h"
+#include "fine.h"
+#include "metrics.h"
+
+/* Bucket upper bounds, in microseconds */
+static const uint64_t bucket_us[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 1000000, 5000000, 30000000,
+};
+
+#define NUM_BUCKETS	(sizeof(bucket_us) / sizeof(bucket_us[0]))
+
+struct histogram {
+	atomic_uint_fast64_t bucket[NUM_BUCKETS + 1];	/* last one is +Inf */
+	atomic_uint_fast64_t sum_ns;
+	atomic_uint_fast64_t count;
+};
+
+static struct {
+	atomic_uint_fast64_t exchanges;
+	atomic_uint_fast64_t exchange_errors;
+	atomic_uint_fast64_t bytes_out;
+	atomic_uint_fast64_t bytes_in;
+	atomic_uint_fast64_t retries;
+	struct histogram exchange;
+
+	struct histogram command[256];
+	atomic_uint_fast64_t command_errors[256];	/* by FINE error code */
+	atomic_uint_fast64_t transport_errors;		/* non-FINE failures */
+
+	atomic_uint_fast64_t boards_passed;
+	atomic_uint_fast64_t boards_failed;
+	struct histogram cycle;
+} m;
+
+#define INC(v, n)	atomic_fetch_add_explicit(&(v), (n), memory_order_relaxed)
+#define GET(v)		atomic_load_explicit(&(v), memory_order_relaxed)
+
+static void histogram_observe(struct histogram *h, uint64_t ns)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_BUCKETS; i++) {
+		if (ns <= bucket_us[i] * 1000)
+			break;
+	}
+
+	INC(h->bucket[i], 1);
+	INC(h->sum_ns, ns);
+	INC(h->count, 1);
+}
+
+void metrics_exchange(uint32_t out_len, uint32_t in_len, uint64_t ns, int error)
+{
+	INC(m.exchanges, 1);
+	INC(m.bytes_out, out_len);
+
+	if (error != JAYLINK_OK) {
+		INC(m.exchange_errors, 1);
+		return;
+	}
+
+	INC(m.bytes_in, in_len);
+	histogram_observe(&m.exchange, ns);
+}
+
+void metrics_command(uint8_t cmd, uint64_t ns, int error)
+{
+	histogram_observe(&m.command[cmd], ns);
+
+	if (error > EXIT_FAILURE && error < 256)
+		INC(m.command_errors[error], 1);
+	else if (error != EXIT_SUCCESS)
+		INC(m.transport_errors, 1);
+}
+
+void metrics_retry(void)
+{
+	INC(m.retries, 1);
+}
+
+void metrics_board(bool passed, uint64_t cycle_ns)
+{
+	if (passed)
+		INC(m.boards_passed, 1);
+	else
+		INC(m.boards_failed, 1);
+
+	histogram_observe(&m.cycle, cycle_ns);
+}
+
+static void write_header(FILE *f, const char *name, const char *type,
+			 const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_histogram(FILE *f, const char *name, const char *labels,
+			    struct histogram *h)
+{
+	uint64_t cumul = 0;
+	const char *sep = labels[0] ? "," : "";
+
+	for (size_t i = 0; i <= NUM_BUCKETS; i++) {
+		cumul += GET(h->bucket[i]);
+		if (i < NUM_BUCKETS)
+			fprintf(f, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name,
+				labels, sep, bucket_us[i] / 1e6, cumul);
+		else
+			fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name,
+				labels, sep, cumul);
+	}
+
+	if (labels[0]) {
+		fprintf(f, "%s_sum{%s} %.9f\n", name, labels, GET(h->sum_ns) / 1e9);
+		fprintf(f, "%s_count{%s} %" PRIu64 "\n", name, labels, (uint64_t)GET(h->count));
+	} else {
+		fprintf(f, "%s_sum %.9f\n", name, GET(h->sum_ns) / 1e9);
+		fprintf(f, "%s_count %" PRIu64 "\n", name, (uint64_t)GET(h->count));
+	}
+}
+
+void metrics_write(FILE *f)
+{
+	char labels[64];
+
+	write_header(f, "fine_exchanges_total", "counter",
+		     "USB exchanges with the probe (jaylink_fine_io calls).");
+	fprintf(f, "fine_exchanges_total %" PRIu64 "\n", (uint64_t)GET(m.exchanges));
+
+	write_header(f, "fine_exchange_errors_total", "counter",
+		     "USB exchanges that failed.");
+	fprintf(f, "fine_exchange_errors_total %" PRIu64 "\n",
+		(uint64_t)GET(m.exchange_errors));
+
+	write_header(f, "fine_bytes_total", "counter", "FINE bytes sent and received.");
+	fprintf(f, "fine_bytes_total{direction=\"out\"} %" PRIu64 "\n",
+		(uint64_t)GET(m.bytes_out));
+	fprintf(f, "fine_bytes_total{direction=\"in\"} %" PRIu64 "\n",
+		(uint64_t)GET(m.bytes_in));
+
+	write_header(f, "fine_retries_total", "counter",
+		     "Start sequence and target ready polls that had to be repeated.");
+	fprintf(f, "fine_retries_total %" PRIu64 "\n", (uint64_t)GET(m.retries));
+
+	write_header(f, "fine_exchange_duration_seconds", "histogram",
+		     "USB exchange round-trip time.");
+	write_histogram(f, "fine_exchange_duration_seconds", "", &m.exchange);
+
+	write_header(f, "fine_command_duration_seconds", "histogram",
+		     "FINE command latency, command to last response byte.");
+	for (int cmd = 0; cmd < 256; cmd++) {
+		const struct fine_cmd_desc *desc = fine_cmd_lookup(cmd);
+
+		if (!GET(m.command[cmd].count))
+			continue;
+
+		if (desc)
+			snprintf(labels, sizeof(labels), "command=\"%s\"", desc->name);
+		else
+			snprintf(labels, sizeof(labels), "command=\"0x%02x\"", cmd);
+		write_histogram(f, "fine_command_duration_seconds", labels,
+				&m.command[cmd]);
+	}
+
+	write_header(f, "fine_command_errors_total", "counter",
+		     "FINE commands that failed, by error class.");
+	/* codes fine_strerror() doesn't know share its text, the code
+	 * keeps their series apart
+	 */
+	for (int code = 0; code < 256; code++) {
+		if (GET(m.command_errors[code]))
+			fprintf(f, "fine_command_errors_total{error=\"%s\",code=\"0x%02x\"} %" PRIu64 "\n",
+				fine_strerror(code), code,
+				(uint64_t)GET(m.command_errors[code]));
+	}
+	fprintf(f, "fine_command_errors_total{error=\"transport\"} %" PRIu64 "\n",
+		(uint64_t)GET(m.transport_errors));
+
+	write_header(f, "station_boards_total", "counter", "Boards run, by result.");
+	fprintf(f, "station_boards_total{result=\"pass\"} %" PRIu64 "\n",
+		(uint64_t)GET(m.boards_passed));
+	fprintf(f, "station_boards_total{result=\"fail\"} %" PRIu64 "\n",
+		(uint64_t)GET(m.boards_failed));
+
+	write_header(f, "station_cycle_seconds", "histogram",
+		     "Board cycle time, attach to end of job.");
+	write_histogram(f, "station_cycle_seconds", "", &m.cycle);
+}
+
+static const char *metrics_path;
+
+void metrics_set_file(const char *path)
+{
+	metrics_path = path;
+}
+
+int metrics_flush(void)
+{
+	const char *path = metrics_path;
+	char tmp[4096];
+	int n;
+	FILE *f;
+
+	if (!path)
+		return EXIT_SUCCESS;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		LOG_ERROR("Metrics path too long: %s", path);
+		return EXIT_FAILURE;
+	}
+
+	f = fopen(tmp, "w");
+	if (!f) {
+		LOG_ERROR("Can't write metrics to %s", tmp);
+		return EXIT_FAILURE;
+	}
+
+	metrics_write(f);
+
+	if (fclose(f) || rename(tmp, path)) {
+		LOG_ERROR("Can't write metrics to %s", path);
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* A client gets this long to send its request, and each write of the
+ * answer as long to go through, so that metrics_stop() never waits on
+ * a stalled scraper.
+ */
+#define METRICS_CLIENT_TIMEOUT_MS	1000
+
+static int server_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t server_thread;
+
+/* Wait for fd to be readable. Returns false on timeout or when stopping. */
+static bool metrics_wait(int fd, int timeout_ms)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = fd, .events = POLLIN },
+		{ .fd = stop_pipe[0], .events = POLLIN },
+	};
+
+	while (poll(pfd, 2, timeout_ms) < 0) {
+		if (errno != EINTR)
+			return false;
+	}
+
+	return !pfd[1].revents && pfd[0].revents;
+}
+
+static void *metrics_server(void *arg)
+{
+	static const char header[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n\r\n";
+	const struct timeval tv = {
+		.tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000,
+		.tv_usec = METRICS_CLIENT_TIMEOUT_MS % 1000 * 1000,
+	};
+	char req[1024];
+
+	(void)arg;
+
+	while (metrics_wait(server_fd, -1)) {
+		int fd = accept(server_fd, NULL, NULL);
+		FILE *f;
+
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		/* Any request gets the metrics */
+		if (!metrics_wait(fd, METRICS_CLIENT_TIMEOUT_MS) ||
+		    read(fd, req, sizeof(req)) < 0) {
+			close(fd);
+			continue;
+		}
+
+		f = fdopen(fd, "w");
+		if (!f) {
+			close(fd);
+			continue;
+		}
+
+		fputs(header, f);
+		metrics_write(f);
+		fclose(f);
+	}
+
+	return NULL;
+}
+
+int metrics_serve(uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int one = 1;
+
+	if (pipe(stop_pipe))
+		return EXIT_FAILURE;
+
+	server_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_fd < 0)
+		goto err;
+
+	setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(server_fd, 4)) {
+		LOG_ERROR("Can't serve metrics on port %u", port);
+		goto err;
+	}
+
+	if (pthread_create(&server_thread, NULL, metrics_server, NULL))
+		goto err;
+
+	printf("Metrics on http://127.0.0.1:%u/metrics\n", port);
+
+	return EXIT_SUCCESS;
+
+err:
+	if (server_fd >= 0)
+		close(server_fd);
+	server_fd = -1;
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	stop_pipe[0] = stop_pipe[1] = -1;
+	return EXIT_FAILURE;
+}
+
+/* The server thread only blocks in poll() or on a client for at most
+ * METRICS_CLIENT_TIMEOUT_MS, so it is back here shortly after the pipe
+ * is written.
+ */
+void metrics_stop(void)
+{
+	if (server_fd < 0)
+		return;
+
+	if (write(stop_pipe[1], "", 1) == 1)
+		pthread_join(server_thread, NULL);
+	else
+		pthread_detach(server_thread);
+
+	close(server_fd);
+	close(stop_pipe[0]);
+	close(stop_pipe[1]);
+	server_fd = -1;
+	stop_pipe[0] = stop_pipe[1] = -1;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Hot path: relaxed atomic increments only, safe from any thread */
+void metrics_exchange(uint32_t out_len, uint32_t in_len, uint64_t ns, int error);
+void metrics_command(uint8_t cmd, uint64_t ns, int error);
+void metrics_retry(void);
+void metrics_board(bool passed, uint64_t cycle_ns);
+
+/* Prometheus text exposition format */
+void metrics_write(FILE *f);
+void metrics_set_file(const char *path);
+int metrics_flush(void);
+int metrics_serve(uint16_t port);
+void metrics_stop(void);
+
+#endif /* METRICS_H */
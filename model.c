@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Timing model of a FINE exchange:
+ *
+ *   usb_rtt + usb_bytes * usb_byte
+ *   + link_bytes * 10 / bitrate
+ *   + the latency of every command completed
+ *   + erase and program time, per unit of the area touched
+ *
+ * The simulator decodes the exchange and counts the work (see
+ * struct model_work); this file turns it into time, and fits the
+ * parameters back from captured exchanges.
+ *
+ * Model files have one parameter per line, `#` starts a comment:
+ *
+ *   usb_rtt_us   250
+ *   usb_byte_ns  20
+ *   link_bitrate 1000000
+ *   command 0x12 150          # per command, microseconds
+ *   erase   0 175000          # per erase unit, by kind of area
+ *   program 0 400             # per write unit, by kind of area
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "fine.h"
+#include "transport.h"
+#include "sim.h"
+#include "model.h"
+
+#define MODEL_DEFAULT_CMD_NS		100000
+#define MODEL_BUCKET_BYTES		32
+#define MODEL_US_MAX			(UINT32_MAX / 1000)	/* kept in ns */
+
+static const char * const cost_names[MODEL_NUM_COSTS] = {
+	[MODEL_COST_USB]	= "usb",
+	[MODEL_COST_LINK]	= "link",
+	[MODEL_COST_COMMAND]	= "command",
+	[MODEL_COST_ERASE]	= "erase",
+	[MODEL_COST_PROGRAM]	= "program",
+};
+
+/* Rough RX65N figures from the datasheet, until calibrated: code flash
+ * 32 KiB blocks and 128 byte writes, data flash 64 byte blocks and
+ * 4 byte writes, config area like data flash.
+ */
+void model_init(struct fine_model *model)
+{
+	memset(model, 0, sizeof(*model));
+
+	model->usb_rtt_ns = 250000;
+	model->usb_byte_ns = 20;
+	model->link_bitrate = 1000000;
+
+	for (int i = 0; i < 256; i++)
+		model->cmd_ns[i] = MODEL_DEFAULT_CMD_NS;
+
+	model->erase_ns[0] = 175000000;
+	model->program_ns[0] = 400000;
+	model->erase_ns[1] = 2600000;
+	model->program_ns[1] = 50000;
+	model->erase_ns[2] = 2600000;
+	model->program_ns[2] = 50000;
+}
+
+static int model_parse_u32(const char *s, uint32_t *val)
+{
+	char *end;
+	unsigned long v;
+
+	/* strtoul() takes "-1" as ULONG_MAX */
+	if (*s == '-')
+		return EXIT_FAILURE;
+
+	errno = 0;
+	v = strtoul(s, &end, 0);
+	if (*end || end == s || errno == ERANGE || v > UINT32_MAX)
+		return EXIT_FAILURE;
+
+	*val = v;
+
+	return EXIT_SUCCESS;
+}
+
+int model_load(struct fine_model *model, const char *path)
+{
+	char line[256];
+	int lineno = 0;
+	FILE *f;
+
+	model_init(model);
+
+	f = fopen(path, "r");
+	if (!f) {
+		LOG_ERROR("Can't open model file %s", path);
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char key[32], sa[32], sb[32];
+		uint32_t a = 0, b = 0;
+		char *hash;
+		int n;
+
+		lineno++;
+
+		hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		n = sscanf(line, "%31s %31s %31s", key, sa, sb);
+		if (n <= 0)
+			continue;
+
+		if ((n >= 2 && model_parse_u32(sa, &a)) ||
+		    (n == 3 && model_parse_u32(sb, &b)))
+			n = 0;		/* not a number: an invalid line */
+
+		if (n == 2 && !strcmp(key, "usb_rtt_us") && a <= MODEL_US_MAX) {
+			model->usb_rtt_ns = a * 1000;
+		} else if (n == 2 && !strcmp(key, "usb_byte_ns")) {
+			model->usb_byte_ns = a;
+		} else if (n == 2 && !strcmp(key, "link_bitrate") && a) {
+			model->link_bitrate = a;
+		} else if (n == 3 && !strcmp(key, "command") && a < 256 &&
+			   b <= MODEL_US_MAX) {
+			model->cmd_ns[a] = b * 1000;
+		} else if (n == 3 && !strcmp(key, "erase") && a < MODEL_MAX_KOA &&
+			   b <= MODEL_US_MAX) {
+			model->erase_ns[a] = b * 1000;
+		} else if (n == 3 && !strcmp(key, "program") && a < MODEL_MAX_KOA &&
+			   b <= MODEL_US_MAX) {
+			model->program_ns[a] = b * 1000;
+		} else {
+			LOG_ERROR("%s:%d: invalid line", path, lineno);
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fclose(f);
+
+	return EXIT_SUCCESS;
+}
+
+int model_save(const struct fine_model *model, const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		LOG_ERROR("Can't write model file %s", path);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(f, "usb_rtt_us   %" PRIu32 "\n", model->usb_rtt_ns / 1000);
+	fprintf(f, "usb_byte_ns  %" PRIu32 "\n", model->usb_byte_ns);
+	fprintf(f, "link_bitrate %" PRIu32 "\n", model->link_bitrate);
+
+	for (int i = 0; i < 256; i++) {
+		const struct fine_cmd_desc *desc = fine_cmd_lookup(i);
+
+		if (desc)
+			fprintf(f, "command 0x%02x %-8" PRIu32 "# %s\n", i,
+				model->cmd_ns[i] / 1000, desc->name);
+	}
+
+	for (int i = 0; i < MODEL_MAX_KOA; i++) {
+		if (model->erase_ns[i] || model->program_ns[i])
+			fprintf(f, "erase   %d %" PRIu32 "\nprogram %d %" PRIu32 "\n",
+				i, model->erase_ns[i] / 1000, i, model->program_ns[i] / 1000);
+	}
+
+	if (fclose(f)) {
+		LOG_ERROR("Can't write model file %s", path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static uint64_t model_link_ns(const struct fine_model *model,
+			      const struct model_work *work)
+{
+	uint32_t bitrate = work->link_bitrate ? work->link_bitrate : model->link_bitrate;
+
+	/* 8N1 framing on the wire */
+	return (uint64_t)work->link_bytes * 10 * 1000000000 / bitrate;
+}
+
+uint64_t model_cost(const struct fine_model *model, const struct model_work *work,
+		    uint64_t cost[MODEL_NUM_COSTS])
+{
+	uint64_t c[MODEL_NUM_COSTS] = { 0 };
+	uint64_t total = 0;
+
+	c[MODEL_COST_USB] = model->usb_rtt_ns +
+			    (uint64_t)work->usb_bytes * model->usb_byte_ns;
+	c[MODEL_COST_LINK] = model_link_ns(model, work);
+
+	for (int i = 0; i < work->num_cmds; i++)
+		c[MODEL_COST_COMMAND] += model->cmd_ns[work->cmds[i]];
+
+	for (int i = 0; i < MODEL_MAX_KOA; i++) {
+		c[MODEL_COST_ERASE] += (uint64_t)work->erase_units[i] * model->erase_ns[i];
+		c[MODEL_COST_PROGRAM] += (uint64_t)work->program_units[i] * model->program_ns[i];
+	}
+
+	for (int i = 0; i < MODEL_NUM_COSTS; i++) {
+		total += c[i];
+		if (cost)
+			cost[i] += c[i];
+	}
+
+	return total;
+}
+
+void model_report(const uint64_t cost[MODEL_NUM_COSTS])
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < MODEL_NUM_COSTS; i++)
+		total += cost[i];
+
+	printf("%-15s %12s %6s\n", "predicted", "time (ms)", "%");
+
+	for (int i = 0; i < MODEL_NUM_COSTS; i++)
+		printf("%-15s %12.3f %5.1f\n", cost_names[i], cost[i] / 1e6,
+			total ? 100.0 * cost[i] / total : 0.0);
+
+	printf("%-15s %12.3f\n", "total", total / 1e6);
+}
+
+struct capture_record {
+	uint32_t out_off;
+	uint32_t out_len;
+	uint32_t in_len;
+	uint64_t ns;
+};
+
+struct capture {
+	struct fine_transport t;
+	struct fine_transport *inner;
+
+	uint8_t *out;
+	uint32_t out_size;
+	uint32_t out_used;
+
+	struct capture_record *records;
+	uint32_t num_records;
+	uint32_t max_records;
+
+	/* an exchange couldn't be kept, the capture can't calibrate */
+	bool incomplete;
+};
+
+static int capture_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+		      uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct capture *cap = t->priv;
+	struct capture_record *rec;
+	uint64_t start = transport_now_ns(cap->inner);
+	int ret;
+
+	ret = cap->inner->io(cap->inner, out, in, out_len, in_len, timeout);
+	if (ret != JAYLINK_OK || cap->incomplete)
+		return ret;
+
+	if (cap->num_records == cap->max_records) {
+		uint32_t max = cap->max_records ? cap->max_records * 2 : 1024;
+
+		rec = realloc(cap->records, max * sizeof(*rec));
+		if (!rec)
+			goto err;
+		cap->records = rec;
+		cap->max_records = max;
+	}
+
+	while (cap->out_used + out_len > cap->out_size) {
+		uint32_t size = cap->out_size ? cap->out_size * 2 : 65536;
+		uint8_t *buf = realloc(cap->out, size);
+
+		if (!buf)
+			goto err;
+		cap->out = buf;
+		cap->out_size = size;
+	}
+
+	rec = &cap->records[cap->num_records++];
+	rec->out_off = cap->out_used;
+	rec->out_len = out_len;
+	rec->in_len = in_len;
+	rec->ns = transport_now_ns(cap->inner) - start;
+
+	memcpy(&cap->out[cap->out_used], out, out_len);
+	cap->out_used += out_len;
+
+	return ret;
+
+err:
+	LOG_ERROR("Out of memory after %" PRIu32 " captured exchanges, can't calibrate",
+		  cap->num_records);
+	cap->incomplete = true;
+	return ret;
+}
+
+static uint64_t capture_now(struct fine_transport *t)
+{
+	struct capture *cap = t->priv;
+
+	return transport_now_ns(cap->inner);
+}
+
+static void capture_free(struct fine_transport *t)
+{
+	struct capture *cap = t->priv;
+
+	transport_free(cap->inner);
+	free(cap->out);
+	free(cap->records);
+	free(cap);
+}
+
+struct fine_transport *model_capture_new(struct fine_transport *inner)
+{
+	struct capture *cap = calloc(1, sizeof(*cap));
+
+	if (!cap)
+		return NULL;
+
+	cap->t.name = inner->name;
+	cap->t.io = capture_io;
+	cap->t.free = capture_free;
+	cap->t.now = capture_now;
+	cap->t.priv = cap;
+	cap->inner = inner;
+
+	return &cap->t;
+}
+
+static bool work_has_units(const struct model_work *work)
+{
+	for (int i = 0; i < MODEL_MAX_KOA; i++) {
+		if (work->erase_units[i] || work->program_units[i])
+			return true;
+	}
+
+	return false;
+}
+
+/* Transport cost is fitted on the exchanges that make the target do
+ * nothing but move bytes, using the fastest exchange of each size: the
+ * target can only make an exchange slower, never faster. What is left
+ * of the other exchanges is target time, shared between the commands,
+ * erase units and write units they carry. The simulator takes the
+ * board's area layout, when it was read, and its stub state so that
+ * units land on the right kind of area and stub writes decode.
+ */
+int model_calibrate(struct fine_transport *capture, struct fine_model *model,
+		    const struct fine_mem_info *mem, bool stub)
+{
+	struct capture *cap = capture->priv;
+	struct fine_transport *sim;
+	struct model_work *work;
+	uint64_t *min_ns = NULL;
+	uint32_t num_buckets = 0;
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	int n = 0;
+	double cmd_sum[256] = { 0 };
+	uint32_t cmd_count[256] = { 0 };
+	double erase_sum[MODEL_MAX_KOA] = { 0 }, program_sum[MODEL_MAX_KOA] = { 0 };
+	uint64_t erase_units[MODEL_MAX_KOA] = { 0 }, program_units[MODEL_MAX_KOA] = { 0 };
+	uint8_t in[FINE_QUEUE_IN_MAX];
+
+	if (cap->incomplete)
+		return EXIT_FAILURE;
+
+	if (!cap->num_records) {
+		LOG_ERROR("Nothing captured to calibrate from");
+		return EXIT_FAILURE;
+	}
+
+	sim = sim_new();
+	work = calloc(cap->num_records, sizeof(*work));
+	if (!sim || !work)
+		goto err;
+
+	if (mem && sim_set_layout(sim, mem) != EXIT_SUCCESS)
+		goto err;
+	sim_set_stub(sim, stub);
+
+	for (uint32_t i = 0; i < cap->num_records; i++) {
+		const struct capture_record *rec = &cap->records[i];
+
+		if (rec->in_len > sizeof(in) ||
+		    sim->io(sim, &cap->out[rec->out_off], in, rec->out_len,
+			    rec->in_len, 0) != JAYLINK_OK)
+			goto err;
+		sim_get_work(sim, &work[i]);
+
+		if (work[i].num_cmds || work_has_units(&work[i]))
+			continue;
+
+		uint32_t b = work[i].usb_bytes / MODEL_BUCKET_BYTES;
+		int64_t ns = rec->ns - model_link_ns(model, &work[i]);
+
+		if (b >= num_buckets) {
+			uint64_t *tmp = realloc(min_ns, (b + 1) * sizeof(*tmp));
+
+			if (!tmp)
+				goto err;
+			for (uint32_t k = num_buckets; k <= b; k++)
+				tmp[k] = UINT64_MAX;
+			min_ns = tmp;
+			num_buckets = b + 1;
+		}
+
+		if (ns > 0 && (uint64_t)ns < min_ns[b])
+			min_ns[b] = ns;
+	}
+
+	for (uint32_t b = 0; b < num_buckets; b++) {
+		double x = (b + 0.5) * MODEL_BUCKET_BYTES;
+
+		if (min_ns[b] == UINT64_MAX)
+			continue;
+		sx += x;
+		sy += min_ns[b];
+		sxx += x * x;
+		sxy += x * min_ns[b];
+		n++;
+	}
+
+	if (n >= 2 && n * sxx - sx * sx > 0) {
+		double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+		double icpt = (sy - slope * sx) / n;
+
+		model->usb_byte_ns = slope > 0 ? slope : 0;
+		model->usb_rtt_ns = icpt > 0 ? icpt : 0;
+	} else if (n == 1) {
+		model->usb_rtt_ns = sy;
+	}
+
+	/* Commands first, from exchanges without flash work */
+	for (uint32_t i = 0; i < cap->num_records; i++) {
+		struct model_work w = work[i];
+		double left;
+
+		if (!w.num_cmds || work_has_units(&w))
+			continue;
+
+		w.num_cmds = 0;
+		left = (double)cap->records[i].ns - model_cost(model, &w, NULL);
+		for (int k = 0; k < work[i].num_cmds; k++) {
+			cmd_sum[work[i].cmds[k]] += left / work[i].num_cmds;
+			cmd_count[work[i].cmds[k]]++;
+		}
+	}
+
+	for (int i = 0; i < 256; i++) {
+		if (cmd_count[i])
+			model->cmd_ns[i] = cmd_sum[i] > 0 ? cmd_sum[i] / cmd_count[i] : 0;
+	}
+
+	/* Then flash work, once command latencies are known */
+	for (uint32_t i = 0; i < cap->num_records; i++) {
+		struct model_work w = work[i];
+		uint64_t units = 0;
+		double left;
+
+		if (!work_has_units(&w))
+			continue;
+
+		memset(w.erase_units, 0, sizeof(w.erase_units));
+		memset(w.program_units, 0, sizeof(w.program_units));
+		left = (double)cap->records[i].ns - model_cost(model, &w, NULL);
+
+		for (int k = 0; k < MODEL_MAX_KOA; k++)
+			units += work[i].erase_units[k] + work[i].program_units[k];
+
+		for (int k = 0; k < MODEL_MAX_KOA; k++) {
+			erase_sum[k] += left * work[i].erase_units[k] / units;
+			erase_units[k] += work[i].erase_units[k];
+			program_sum[k] += left * work[i].program_units[k] / units;
+			program_units[k] += work[i].program_units[k];
+		}
+	}
+
+	for (int k = 0; k < MODEL_MAX_KOA; k++) {
+		if (erase_units[k])
+			model->erase_ns[k] = erase_sum[k] > 0 ? erase_sum[k] / erase_units[k] : 0;
+		if (program_units[k])
+			model->program_ns[k] = program_sum[k] > 0 ?
+					       program_sum[k] / program_units[k] : 0;
+	}
+
+	printf("Calibrated from %" PRIu32 " exchanges: USB round trip %.1f us, %" PRIu32 " ns/byte\n",
+		cap->num_records, model->usb_rtt_ns / 1e3, model->usb_byte_ns);
+
+	free(min_ns);
+	free(work);
+	transport_free(sim);
+
+	return EXIT_SUCCESS;
+
+err:
+	LOG_ERROR("Calibration failed");
+	free(min_ns);
+	free(work);
+	transport_free(sim);
+
+	return EXIT_FAILURE;
+}
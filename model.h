@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct fine_transport;
+struct fine_mem_info;
+
+#define MODEL_MAX_KOA			4	/* kinds of area: code, data, config */
+#define MODEL_MAX_CMDS			8
+
+/* What one exchange makes the probe and the target do, as counted by
+ * the simulator while decoding the sub-command stream.
+ */
+struct model_work {
+	uint32_t usb_bytes;		/* out + in */
+	uint32_t link_bytes;		/* packet bytes on the FINE wire */
+	uint32_t link_bitrate;		/* 0 until set by the bitrate command */
+	int num_cmds;
+	uint8_t cmds[MODEL_MAX_CMDS];	/* commands completed */
+	uint32_t erase_units[MODEL_MAX_KOA];
+	uint32_t program_units[MODEL_MAX_KOA];
+};
+
+enum model_cost {
+	MODEL_COST_USB,
+	MODEL_COST_LINK,
+	MODEL_COST_COMMAND,
+	MODEL_COST_ERASE,
+	MODEL_COST_PROGRAM,
+	MODEL_NUM_COSTS,
+};
+
+/* Times are in nanoseconds. Erase and program times are per erase or
+ * write unit of the area, indexed by kind of area (koa).
+ */
+struct fine_model {
+	uint32_t usb_rtt_ns;
+	uint32_t usb_byte_ns;
+	uint32_t link_bitrate;		/* before the bitrate command */
+	uint32_t cmd_ns[256];
+	uint32_t erase_ns[MODEL_MAX_KOA];
+	uint32_t program_ns[MODEL_MAX_KOA];
+};
+
+void model_init(struct fine_model *model);
+int model_load(struct fine_model *model, const char *path);
+int model_save(const struct fine_model *model, const char *path);
+
+/* Time taken by one exchange, split by cost when cost is not NULL */
+uint64_t model_cost(const struct fine_model *model, const struct model_work *work,
+		    uint64_t cost[MODEL_NUM_COSTS]);
+void model_report(const uint64_t cost[MODEL_NUM_COSTS]);
+
+/* Calibration: exchanges are captured with their measured time while a
+ * job runs on real hardware, then decoded by a simulator set up like
+ * the board and fitted once the job is done.
+ */
+struct fine_transport *model_capture_new(struct fine_transport *inner);
+int model_calibrate(struct fine_transport *capture, struct fine_model *model,
+		    const struct fine_mem_info *mem, bool stub);
+
+#endif /* MODEL_H */
@@ -0,0 +1,582 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Plan file layout, in host byte order, mapped in place when run:
+ *
+ *   struct plan_file_header
+ *   struct plan_step    steps[num_steps]
+ *   exchanges, each:
+ *     struct plan_record
+ *     uint8_t out[out_len]
+ *     uint8_t in[in_len]	expected answer
+ *     uint8_t mask[in_len]	non-zero for the bytes compared
+ *
+ * The header hash covers everything after it.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "log.h"
+#include "fine.h"
+#include "metrics.h"
+#include "transport.h"
+#include "sim.h"
+#include "prep.h"
+#include "job.h"
+#include "plan.h"
+
+#define PLAN_MAGIC			"RXPLAN\0"
+#define PLAN_VERSION			2
+
+#define PLAN_CMD_START			0x100	/* with the command code */
+
+struct plan_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_steps;
+	uint64_t hash;
+	uint32_t data_len;
+	uint32_t num_exchanges;
+};
+
+struct plan_step {
+	uint32_t type;
+	uint32_t line;
+	uint32_t off;
+	uint32_t len;
+};
+
+struct plan_record {
+	uint32_t out_len;
+	uint32_t in_len;
+	uint32_t timeout;
+	uint32_t cmd;			/* PLAN_CMD_START when a command starts */
+};
+
+/* Compile time: keeps every exchange with its answer, following the
+ * packets sent and read to know what fine.c would look at.
+ */
+struct plan_writer {
+	struct fine_transport t;
+	struct fine_transport *inner;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	uint32_t count;
+
+	uint8_t host_hdr[4];		/* host packet being sent */
+	uint32_t host_pos;
+	uint32_t host_len;
+	uint8_t target_hdr[3];		/* target packet being read */
+	uint32_t target_pos;
+	uint32_t target_len;
+};
+
+static bool plan_packet_done(uint32_t pos, uint32_t len)
+{
+	return len && pos >= len;
+}
+
+/* A packet word sent. Notes the command of a host packet starting here;
+ * words that don't start a packet (chip init) are passed over.
+ */
+static void plan_writer_host(struct plan_writer *w, const uint8_t *word, uint32_t *cmd)
+{
+	if (plan_packet_done(w->host_pos, w->host_len))
+		w->host_pos = w->host_len = 0;
+
+	if (!w->host_pos && word[0] != FINE_CMD_SOH && word[0] != (FINE_CMD_SOH | PKT_STATUS))
+		return;
+
+	/* Bytes past the end of the packet are padding */
+	for (int k = 0; k < 4 && !plan_packet_done(w->host_pos, w->host_len); k++) {
+		if (w->host_pos < 4)
+			w->host_hdr[w->host_pos] = word[k];
+		w->host_pos++;
+		if (w->host_pos == 3)
+			w->host_len = ((w->host_hdr[1] << 8) | w->host_hdr[2]) + 5;
+		if (w->host_pos == 4 && w->host_hdr[0] == FINE_CMD_SOH)
+			*cmd = PLAN_CMD_START | w->host_hdr[3];
+	}
+
+	/* Whatever the target sends next is a new packet */
+	w->target_pos = w->target_len = 0;
+}
+
+/* A data byte of the target packet: compared unless past its ETX */
+static uint8_t plan_writer_target(struct plan_writer *w, uint8_t b)
+{
+	if (plan_packet_done(w->target_pos, w->target_len))
+		return 0;
+
+	if (w->target_pos < 3)
+		w->target_hdr[w->target_pos] = b;
+	if (++w->target_pos == 3)
+		w->target_len = ((w->target_hdr[1] << 8) | w->target_hdr[2]) + 5;
+
+	return 1;
+}
+
+/* Walk the sub-commands of an exchange as the simulator does and mark in
+ * mask the answer bytes fine.c checks on a live run: acks, chip ID and
+ * the packet bytes of data words. Answers to packet words, the status
+ * byte of data words and what follows a target packet's ETX are left
+ * out.
+ */
+static int plan_writer_scan(struct plan_writer *w, const uint8_t *out, uint32_t out_len,
+			    const uint8_t *in, uint8_t *mask, uint32_t in_len,
+			    uint32_t *cmd)
+{
+	uint32_t i = 0;
+	uint32_t n = 0;
+
+	while (i < out_len) {
+		switch (out[i]) {
+		case FINE_OP_START:
+			if (i + 4 > out_len || n + 2 > in_len)
+				return EXIT_FAILURE;
+			mask[n++] = 1;
+			mask[n++] = 1;
+			i += 4;
+			break;
+		case FINE_OP_CONFIG:
+			i += 3;
+			break;
+		case FINE_GET_CHIP_ID:
+		case FINE_ASK_TARGET_ACK:
+			if (n + 2 > in_len)
+				return EXIT_FAILURE;
+			mask[n++] = 1;
+			mask[n++] = 1;
+			i++;
+			break;
+		case FINE_OP_WRITE:
+			if (i + 5 > out_len || n + 1 > in_len)
+				return EXIT_FAILURE;
+			plan_writer_host(w, &out[i + 1], cmd);
+			mask[n++] = 0;
+			i += 5;
+			break;
+		case FINE_ASK_TARGET_DATA:
+			/* A status poll, or the status byte and four packet bytes */
+			if (n + 5 > in_len) {
+				if (n + 1 > in_len)
+					return EXIT_FAILURE;
+				mask[n++] = 1;
+				i++;
+				break;
+			}
+			if (plan_packet_done(w->target_pos, w->target_len))
+				w->target_pos = w->target_len = 0;
+			mask[n++] = 0;
+			for (int k = 0; k < 4; k++, n++)
+				mask[n] = plan_writer_target(w, in[n]);
+			i++;
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	return n == in_len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int plan_writer_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+			  uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct plan_writer *w = t->priv;
+	struct plan_record r = {
+		.out_len = out_len,
+		.in_len = in_len,
+		.timeout = timeout,
+	};
+	size_t need = sizeof(r) + out_len + 2 * in_len;
+	uint8_t *rec;
+	int ret;
+
+	ret = w->inner->io(w->inner, out, in, out_len, in_len, timeout);
+	if (ret != JAYLINK_OK)
+		return ret;
+
+	while (w->len + need > w->size) {
+		size_t size = w->size ? w->size * 2 : 65536;
+		uint8_t *buf = realloc(w->buf, size);
+
+		if (!buf)
+			return JAYLINK_ERR;
+		w->buf = buf;
+		w->size = size;
+	}
+
+	rec = &w->buf[w->len];
+	if (plan_writer_scan(w, out, out_len, in, &rec[sizeof(r) + out_len + in_len],
+			     in_len, &r.cmd)) {
+		LOG_ERROR("Plan: can't follow exchange %" PRIu32, w->count);
+		return JAYLINK_ERR;
+	}
+
+	memcpy(rec, &r, sizeof(r));
+	memcpy(&rec[sizeof(r)], out, out_len);
+	memcpy(&rec[sizeof(r) + out_len], in, in_len);
+	w->len += need;
+	w->count++;
+
+	return ret;
+}
+
+static uint64_t plan_writer_now(struct fine_transport *t)
+{
+	struct plan_writer *w = t->priv;
+
+	return transport_now_ns(w->inner);
+}
+
+static void plan_writer_free(struct fine_transport *t)
+{
+	struct plan_writer *w = t->priv;
+
+	transport_free(w->inner);
+	free(w->buf);
+	free(w);
+}
+
+static int plan_save(const char *path, const struct plan_step *steps,
+		     uint32_t num_steps, const struct plan_writer *w)
+{
+	struct plan_file_header hdr = {
+		.magic = PLAN_MAGIC,
+		.version = PLAN_VERSION,
+		.num_steps = num_steps,
+		.data_len = w->len,
+		.num_exchanges = w->count,
+	};
+	size_t steps_len = num_steps * sizeof(*steps);
+	char tmp[4096];
+	int n;
+	FILE *f;
+
+	hdr.hash = prep_hash(0, steps, steps_len);
+	hdr.hash = prep_hash(hdr.hash, w->buf, w->len);
+
+	n = snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp)) {
+		LOG_ERROR("Plan path too long: %s", path);
+		return EXIT_FAILURE;
+	}
+
+	f = fopen(tmp, "wb");
+	if (!f) {
+		LOG_ERROR("Can't create %s", tmp);
+		return EXIT_FAILURE;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(steps, steps_len, 1, f) != 1 ||
+	    (w->len && fwrite(w->buf, w->len, 1, f) != 1)) {
+		LOG_ERROR("Can't write %s", tmp);
+		fclose(f);
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		LOG_ERROR("Can't write %s", path);
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int plan_compile(struct job *job, const struct fine_model *model,
+		 const struct fine_profile *profile, const char *path)
+{
+	struct fine_transport *sim;
+	struct fine_session *s;
+	struct plan_writer *w;
+	struct plan_step *steps;
+	int ret = EXIT_SUCCESS;
+
+	for (int i = 0; i < job->num_steps; i++) {
+		if (job->steps[i].type == JOB_PATCH || job->steps[i].type == JOB_READ ||
+		    job->steps[i].type == JOB_STUB) {
+			LOG_ERROR("%s:%d: this step can't be compiled into a plan",
+				  job->path, job->steps[i].line);
+			return EXIT_FAILURE;
+		}
+	}
+
+	sim = sim_new();
+	w = calloc(1, sizeof(*w));
+	steps = calloc(job->num_steps, sizeof(*steps));
+	if (!sim || !w || !steps) {
+		transport_free(sim);
+		free(w);
+		free(steps);
+		return EXIT_FAILURE;
+	}
+
+	sim_set_model(sim, model, false);
+
+	w->t.name = sim->name;
+	w->t.io = plan_writer_io;
+	w->t.free = plan_writer_free;
+	w->t.now = plan_writer_now;
+	w->t.priv = w;
+	w->inner = sim;
+
+	s = fine_session_new(&w->t);
+	if (!s) {
+		free(steps);
+		return EXIT_FAILURE;
+	}
+
+	if (profile)
+		fine_set_profile(s, profile);
+
+	for (int i = 0; i < job->num_steps && ret == EXIT_SUCCESS; i++) {
+		size_t off = w->len;
+
+		w->host_pos = w->host_len = 0;
+		w->target_pos = w->target_len = 0;
+
+		ret = job_run_steps(job, s, i, 1);
+
+		/* Connect runs live */
+		if (job->steps[i].type == JOB_CONNECT)
+			w->len = off;
+
+		steps[i].type = job->steps[i].type;
+		steps[i].line = job->steps[i].line;
+		steps[i].off = off;
+		steps[i].len = w->len - off;
+	}
+
+	if (ret == EXIT_SUCCESS && w->len > UINT32_MAX) {
+		LOG_ERROR("%s: plan too large", job->path);
+		ret = EXIT_FAILURE;
+	}
+
+	if (ret == EXIT_SUCCESS) {
+		job_report(job);
+		ret = plan_save(path, steps, job->num_steps, w);
+	}
+
+	if (ret == EXIT_SUCCESS)
+		printf("Plan %s: %d steps, %" PRIu32 " exchanges, %zu bytes\n", path,
+			job->num_steps, w->count, w->len);
+
+	free(steps);
+	fine_session_free(s);
+
+	return ret;
+}
+
+bool plan_is_plan(const char *path)
+{
+	char magic[8];
+	bool ret = false;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return false;
+
+	if (fread(magic, sizeof(magic), 1, f) == 1)
+		ret = !memcmp(magic, PLAN_MAGIC, sizeof(magic));
+
+	fclose(f);
+
+	return ret;
+}
+
+/* Every record must lie within its step, with answers that fit the
+ * buffer plan_exec() reads them into.
+ */
+static int plan_check_step(const uint8_t *data, const struct plan_step *step)
+{
+	uint32_t pos = 0;
+
+	while (pos < step->len) {
+		struct plan_record r;
+
+		if (step->len - pos < sizeof(r))
+			return EXIT_FAILURE;
+
+		memcpy(&r, &data[step->off + pos], sizeof(r));
+		if (r.out_len > FINE_QUEUE_OUT_MAX || r.in_len > FINE_QUEUE_IN_MAX ||
+		    step->len - pos - sizeof(r) < (uint64_t)r.out_len + 2 * r.in_len)
+			return EXIT_FAILURE;
+
+		pos += sizeof(r) + r.out_len + 2 * r.in_len;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int plan_load(struct job *job, const char *path)
+{
+	const struct plan_file_header *hdr;
+	const struct plan_step *steps;
+	const uint8_t *data;
+	struct stat st;
+	uint8_t *map;
+	int fd;
+
+	memset(job, 0, sizeof(*job));
+	job->path = path;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Can't open plan %s", path);
+		return EXIT_FAILURE;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		goto corrupt;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOG_ERROR("Can't map plan %s", path);
+		return EXIT_FAILURE;
+	}
+
+	job->plan_map = map;
+	job->plan_map_len = st.st_size;
+
+	hdr = (const struct plan_file_header *)map;
+	if (memcmp(hdr->magic, PLAN_MAGIC, sizeof(hdr->magic))) {
+		LOG_ERROR("%s is not a plan", path);
+		goto err;
+	}
+
+	if (hdr->version != PLAN_VERSION) {
+		LOG_ERROR("%s: plan version %" PRIu32 ", expected %d", path, hdr->version,
+			  PLAN_VERSION);
+		goto err;
+	}
+
+	if (!hdr->num_steps ||
+	    sizeof(*hdr) + (uint64_t)hdr->num_steps * sizeof(*steps) + hdr->data_len !=
+	    (uint64_t)st.st_size ||
+	    prep_hash(0, map + sizeof(*hdr), st.st_size - sizeof(*hdr)) != hdr->hash)
+		goto corrupt;
+
+	steps = (const struct plan_step *)(map + sizeof(*hdr));
+	data = (const uint8_t *)&steps[hdr->num_steps];
+
+	job->steps = calloc(hdr->num_steps, sizeof(*job->steps));
+	if (!job->steps)
+		goto err;
+	job->num_steps = hdr->num_steps;
+
+	for (uint32_t i = 0; i < hdr->num_steps; i++) {
+		struct job_step *step = &job->steps[i];
+
+		if (steps[i].type >= JOB_NUM_TYPES || (!i) != (steps[i].type == JOB_CONNECT) ||
+		    (uint64_t)steps[i].off + steps[i].len > hdr->data_len ||
+		    plan_check_step(data, &steps[i]))
+			goto corrupt;
+
+		step->type = steps[i].type;
+		step->line = steps[i].line;
+		step->plan = &data[steps[i].off];
+		step->plan_len = steps[i].len;
+	}
+
+	return EXIT_SUCCESS;
+
+corrupt:
+	LOG_ERROR("%s: corrupted plan", path);
+err:
+	job_free(job);
+	return EXIT_FAILURE;
+}
+
+/* Send the exchanges as compiled, the answers must match where the
+ * mask says. Exchanges and commands are reported to the metrics as a
+ * live run would; a command lasts from the exchange starting its packet
+ * to the next command or the end of the step.
+ */
+int plan_exec(struct fine_session *s, const uint8_t *plan, uint32_t len)
+{
+	struct fine_transport *t = fine_get_transport(s);
+	uint8_t in[FINE_QUEUE_IN_MAX];
+	uint64_t cmd_start = 0;
+	int cmd = -1;
+	uint32_t pos = 0;
+	uint32_t n = 0;
+	int ret = EXIT_SUCCESS;
+
+	while (pos < len && ret == EXIT_SUCCESS) {
+		const uint8_t *out = &plan[pos + sizeof(struct plan_record)];
+		const uint8_t *expect, *mask;
+		struct plan_record r;
+		uint64_t start;
+
+		memcpy(&r, &plan[pos], sizeof(r));
+		expect = out + r.out_len;
+		mask = expect + r.in_len;
+
+		start = fine_now_ns(s);
+		if (r.cmd & PLAN_CMD_START) {
+			if (cmd >= 0)
+				metrics_command(cmd, start - cmd_start, EXIT_SUCCESS);
+			cmd = r.cmd & 0xFF;
+			cmd_start = start;
+		}
+
+		ret = t->io(t, out, in, r.out_len, r.in_len, r.timeout);
+		metrics_exchange(r.out_len, r.in_len, fine_now_ns(s) - start, ret);
+		if (ret != JAYLINK_OK) {
+			LOG_ERROR("Plan: exchange %" PRIu32 " failed: %s", n,
+				  jaylink_strerror(ret));
+			ret = EXIT_FAILURE;
+			break;
+		}
+
+		for (uint32_t i = 0; i < r.in_len; i++) {
+			if (mask[i] && in[i] != expect[i]) {
+				LOG_ERROR("Plan: exchange %" PRIu32 " answer differs from the plan at byte %" PRIu32,
+					  n, i);
+				ret = EXIT_FAILURE;
+				break;
+			}
+		}
+
+		pos += sizeof(r) + r.out_len + 2 * r.in_len;
+		n++;
+	}
+
+	if (cmd >= 0)
+		metrics_command(cmd, fine_now_ns(s) - cmd_start, ret);
+
+	return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct job;
+struct fine_session;
+struct fine_model;
+struct fine_profile;
+
+/* Flash plans: a job compiled down to the exact exchanges it makes, with
+ * the answers a good board gives. The connect step is left to run live,
+ * as the boot firmware may take a variable number of polls to come up;
+ * every later step is a run of exchanges sent as they are, the answers
+ * checked where a live run would check them (acks, packet bytes up to
+ * the ETX).
+ *
+ * The plan is compiled by running the job on the simulator, on the
+ * clock of the timing model, which also sets the timeouts recorded for
+ * each exchange, with the exchange sizes of profile (NULL for the
+ * defaults). Steps whose exchanges differ from board to board (patch,
+ * stub, which falls back on boot firmware that can't run one) or that
+ * keep what they read (read) can't be compiled.
+ */
+int plan_compile(struct job *job, const struct fine_model *model,
+		 const struct fine_profile *profile, const char *path);
+
+/* A plan is loaded as a job whose steps carry their exchanges */
+bool plan_is_plan(const char *path);
+int plan_load(struct job *job, const char *path);
+int plan_exec(struct fine_session *s, const uint8_t *plan, uint32_t len);
+
+#endif /* PLAN_H */
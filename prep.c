@@ -0,0 +1,660 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Prepared images and their cache.
+ *
+ * A cache entry is the prepared image laid out so it can be used in
+ * place once mapped:
+ *
+ *   struct prep_file_header
+ *   struct prep_block  blocks[num_blocks]
+ *   uint8_t            data[data_len]
+ *   uint8_t            frames[frames_len]
+ *
+ * in host byte order. The header carries the key the entry was built
+ * for and a hash of everything after it; any mismatch, as well as a bad
+ * block checksum or out of range offset, makes the entry rebuilt.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdbool.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "log.h"
+#include "fine.h"
+#include "image.h"
+#include "prep.h"
+
+#define PREP_MAGIC			"RXPREP\0"
+#define PREP_VERSION			1
+
+#define FNV_OFFSET			0xcbf29ce484222325ULL
+#define FNV_PRIME			0x100000001b3ULL
+
+struct prep_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_blocks;
+	uint64_t key;
+	uint64_t hash;
+	uint32_t data_len;
+	uint32_t frames_len;
+};
+
+uint64_t prep_hash(uint64_t hash, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	if (!hash)
+		hash = FNV_OFFSET;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+static uint32_t prep_checksum(const uint8_t *data, uint32_t len)
+{
+	return (uint32_t)prep_hash(0, data, len);
+}
+
+static int section_cmp(const void *a, const void *b)
+{
+	const struct image_section *sa = a;
+	const struct image_section *sb = b;
+
+	return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static bool block_erased(const uint8_t *data)
+{
+	for (int i = 0; i < PREP_BLOCK_SIZE; i++) {
+		if (data[i] != PREP_ERASED)
+			return false;
+	}
+
+	return true;
+}
+
+/* Frame the data packets of every block, once data and blocks are set */
+static int prep_frame(struct prep_image *prep)
+{
+	uint32_t frames_len = 0;
+
+	for (uint32_t i = 0; i < prep->num_blocks; i++) {
+		uint32_t len = prep->blocks[i].len;
+		uint32_t packets = (len + PREP_BLOCK_SIZE - 1) / PREP_BLOCK_SIZE;
+
+		prep->blocks[i].frame_off = frames_len;
+		prep->blocks[i].frame_len = len + packets * FINE_FRAME_OVERHEAD;
+		frames_len += prep->blocks[i].frame_len;
+	}
+
+	prep->frames = malloc(frames_len ? frames_len : 1);
+	if (!prep->frames)
+		return EXIT_FAILURE;
+	prep->frames_len = frames_len;
+
+	for (uint32_t i = 0; i < prep->num_blocks; i++) {
+		struct prep_block *blk = &prep->blocks[i];
+		uint8_t *frame = &prep->frames[blk->frame_off];
+
+		for (uint32_t off = 0; off < blk->len; off += PREP_BLOCK_SIZE) {
+			uint32_t n = blk->len - off;
+
+			if (n > PREP_BLOCK_SIZE)
+				n = PREP_BLOCK_SIZE;
+
+			frame += fine_frame_packet(frame, PKT_STATUS, FINE_CMD_WRITE,
+						   &prep->data[blk->data_off + off], n);
+		}
+
+		blk->checksum = prep_checksum(&prep->data[blk->data_off], blk->len);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int prep_build(struct prep_image *prep, struct image *image)
+{
+	uint32_t *addrs = NULL;
+	uint32_t count = 0;
+	uint32_t kept = 0;
+
+	memset(prep, 0, sizeof(*prep));
+
+	qsort(image->sections, image->num_sections, sizeof(*image->sections),
+	      section_cmp);
+
+	/* Every block touched by the image, padded with the erased value */
+	for (int i = 0; i < image->num_sections; i++) {
+		struct image_section *sec = &image->sections[i];
+		uint64_t first = sec->addr & ~(uint64_t)(PREP_BLOCK_SIZE - 1);
+		uint64_t end = (uint64_t)sec->addr + sec->size;
+
+		if (!sec->size)
+			continue;
+
+		for (uint64_t b = first; b < end; b += PREP_BLOCK_SIZE) {
+			if (count && b <= addrs[count - 1])
+				continue;
+
+			uint32_t *tmp = realloc(addrs, (count + 1) * sizeof(*addrs));
+			uint8_t *data = realloc(prep->data, (count + 1) * PREP_BLOCK_SIZE);
+
+			if (tmp)
+				addrs = tmp;
+			if (data)
+				prep->data = data;
+			if (!tmp || !data)
+				goto err;
+
+			addrs[count] = b;
+			memset(&prep->data[count * PREP_BLOCK_SIZE], PREP_ERASED,
+			       PREP_BLOCK_SIZE);
+			count++;
+		}
+
+		/* Sections are sorted, so the blocks from first to the last
+		 * one added are contiguous in data.
+		 */
+		uint8_t *base = &prep->data[(count - 1) * PREP_BLOCK_SIZE -
+					    (addrs[count - 1] - first)];
+
+		memcpy(&base[sec->addr - first], sec->data, sec->size);
+	}
+
+	/* Drop blocks left erased, merge contiguous ones into one write */
+	for (uint32_t i = 0; i < count; i++) {
+		struct prep_block *blk;
+
+		if (block_erased(&prep->data[i * PREP_BLOCK_SIZE]))
+			continue;
+
+		if (kept != i)
+			memmove(&prep->data[kept * PREP_BLOCK_SIZE],
+				&prep->data[i * PREP_BLOCK_SIZE], PREP_BLOCK_SIZE);
+
+		blk = prep->num_blocks ? &prep->blocks[prep->num_blocks - 1] : NULL;
+		if (blk && blk->addr + blk->len == addrs[i]) {
+			blk->len += PREP_BLOCK_SIZE;
+		} else {
+			blk = realloc(prep->blocks, (prep->num_blocks + 1) * sizeof(*blk));
+			if (!blk)
+				goto err;
+			prep->blocks = blk;
+			blk = &prep->blocks[prep->num_blocks++];
+			memset(blk, 0, sizeof(*blk));
+			blk->addr = addrs[i];
+			blk->len = PREP_BLOCK_SIZE;
+			blk->data_off = kept * PREP_BLOCK_SIZE;
+		}
+
+		kept++;
+	}
+
+	free(addrs);
+	addrs = NULL;
+	prep->data_len = kept * PREP_BLOCK_SIZE;
+
+	if (prep_frame(prep))
+		goto err;
+
+	return EXIT_SUCCESS;
+
+err:
+	free(addrs);
+	prep_free(prep);
+	return EXIT_FAILURE;
+}
+
+int prep_build_raw(struct prep_image *prep, uint32_t addr, const uint8_t *data,
+		   uint32_t len)
+{
+	memset(prep, 0, sizeof(*prep));
+
+	prep->blocks = calloc(1, sizeof(*prep->blocks));
+	prep->data = malloc(len);
+	if (!prep->blocks || !prep->data) {
+		prep_free(prep);
+		return EXIT_FAILURE;
+	}
+
+	memcpy(prep->data, data, len);
+	prep->data_len = len;
+	prep->num_blocks = 1;
+	prep->blocks[0].addr = addr;
+	prep->blocks[0].len = len;
+
+	if (prep_frame(prep)) {
+		prep_free(prep);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void prep_free(struct prep_image *prep)
+{
+	for (uint32_t i = 0; i < prep->num_patches; i++)
+		free(prep->patches[i].value);
+	for (uint32_t i = 0; i < prep->num_segments; i++)
+		free(prep->segments[i].frames);
+	free(prep->patches);
+	free(prep->segments);
+
+	if (prep->map) {
+		munmap(prep->map, prep->map_len);
+	} else {
+		free(prep->blocks);
+		free(prep->data);
+		free(prep->frames);
+	}
+
+	memset(prep, 0, sizeof(*prep));
+}
+
+static int prep_map(struct prep_image *prep, const char *path, uint64_t key)
+{
+	const struct prep_file_header *hdr;
+	struct stat st;
+	size_t expected;
+	uint8_t *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		goto corrupt;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return EXIT_FAILURE;
+
+	memset(prep, 0, sizeof(*prep));
+	prep->map = map;
+	prep->map_len = st.st_size;
+
+	hdr = (const struct prep_file_header *)map;
+	if (memcmp(hdr->magic, PREP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != PREP_VERSION || hdr->key != key)
+		goto bad;
+
+	expected = sizeof(*hdr) + (size_t)hdr->num_blocks * sizeof(struct prep_block) +
+		   hdr->data_len + hdr->frames_len;
+	if (expected != (size_t)st.st_size ||
+	    prep_hash(0, map + sizeof(*hdr), st.st_size - sizeof(*hdr)) != hdr->hash)
+		goto bad;
+
+	prep->num_blocks = hdr->num_blocks;
+	prep->data_len = hdr->data_len;
+	prep->frames_len = hdr->frames_len;
+	prep->blocks = (struct prep_block *)(map + sizeof(*hdr));
+	prep->data = (uint8_t *)&prep->blocks[prep->num_blocks];
+	prep->frames = prep->data + prep->data_len;
+
+	for (uint32_t i = 0; i < prep->num_blocks; i++) {
+		const struct prep_block *blk = &prep->blocks[i];
+
+		if ((uint64_t)blk->data_off + blk->len > prep->data_len ||
+		    (uint64_t)blk->frame_off + blk->frame_len > prep->frames_len ||
+		    prep_checksum(&prep->data[blk->data_off], blk->len) != blk->checksum)
+			goto bad;
+	}
+
+	return EXIT_SUCCESS;
+
+bad:
+	prep_free(prep);
+corrupt:
+	LOG_WARNING("Cache entry %s is stale or corrupt, rebuilding", path);
+	unlink(path);
+	return EXIT_FAILURE;
+}
+
+static int prep_save(const struct prep_image *prep, const char *path, uint64_t key)
+{
+	struct prep_file_header hdr;
+	char tmp[4096];
+	int n;
+	FILE *f;
+	size_t blocks_len = prep->num_blocks * sizeof(struct prep_block);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PREP_MAGIC, sizeof(hdr.magic));
+	hdr.version = PREP_VERSION;
+	hdr.num_blocks = prep->num_blocks;
+	hdr.key = key;
+	hdr.data_len = prep->data_len;
+	hdr.frames_len = prep->frames_len;
+	hdr.hash = prep_hash(0, prep->blocks, blocks_len);
+	hdr.hash = prep_hash(hdr.hash, prep->data, prep->data_len);
+	hdr.hash = prep_hash(hdr.hash, prep->frames, prep->frames_len);
+
+	/* A truncated name would be renamed over the wrong file */
+	n = snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	if (n < 0 || (size_t)n >= sizeof(tmp))
+		return EXIT_FAILURE;
+
+	f = fopen(tmp, "wb");
+	if (!f)
+		return EXIT_FAILURE;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    (blocks_len && fwrite(prep->blocks, blocks_len, 1, f) != 1) ||
+	    (prep->data_len && fwrite(prep->data, prep->data_len, 1, f) != 1) ||
+	    (prep->frames_len && fwrite(prep->frames, prep->frames_len, 1, f) != 1)) {
+		fclose(f);
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
+
+	if (fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+	struct stat st;
+	uint8_t *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !(buf = malloc(st.st_size ? st.st_size : 1))) {
+		close(fd);
+		return NULL;
+	}
+
+	if (read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+
+	close(fd);
+	*len = st.st_size;
+
+	return buf;
+}
+
+int prep_load(struct prep_image *prep, const char *path, const uint32_t *base_addr,
+	      const char *cache_dir)
+{
+	const uint32_t geometry[] = { PREP_VERSION, PREP_BLOCK_SIZE, PREP_ERASED,
+				      FINE_MAX_DATA_LEN, base_addr ? 1 : 0,
+				      base_addr ? *base_addr : 0 };
+	char entry[4096];
+	struct image image;
+	uint64_t key;
+	uint8_t *content;
+	size_t len;
+	int ret;
+
+	if (cache_dir) {
+		content = read_file(path, &len);
+		if (!content) {
+			LOG_ERROR("Can't read %s", path);
+			return EXIT_FAILURE;
+		}
+
+		key = prep_hash(0, geometry, sizeof(geometry));
+		key = prep_hash(key, content, len);
+		free(content);
+
+		snprintf(entry, sizeof(entry), "%s/%016" PRIx64 ".prep", cache_dir, key);
+
+		if (!access(entry, F_OK) && prep_map(prep, entry, key) == EXIT_SUCCESS) {
+			LOG_DEBUG("%s: cache hit %s", path, entry);
+			return EXIT_SUCCESS;
+		}
+	}
+
+	ret = image_load(&image, path, base_addr);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	ret = prep_build(prep, &image);
+	image_free(&image);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	if (cache_dir && prep_save(prep, entry, key) != EXIT_SUCCESS)
+		LOG_WARNING("Can't write cache entry %s", entry);
+
+	return EXIT_SUCCESS;
+}
+
+/* Packet holding offset off of a block, as laid out by prep_frame() */
+static uint32_t prep_packet_off(const struct prep_block *blk, uint32_t off)
+{
+	return blk->frame_off + off / PREP_BLOCK_SIZE *
+	       (PREP_BLOCK_SIZE + FINE_FRAME_OVERHEAD);
+}
+
+static int segment_cmp(const void *a, const void *b)
+{
+	const struct prep_segment *sa = a;
+	const struct prep_segment *sb = b;
+
+	if (sa->block != sb->block)
+		return sa->block < sb->block ? -1 : 1;
+
+	return sa->frame_off < sb->frame_off ? -1 : sa->frame_off > sb->frame_off;
+}
+
+int prep_add_patch(struct prep_image *prep, uint32_t addr, uint32_t len)
+{
+	const struct prep_block *blk = NULL;
+	struct prep_segment *seg;
+	struct prep_patch *patch;
+	uint32_t start, end;
+	uint32_t block;
+
+	for (block = 0; block < prep->num_blocks; block++) {
+		blk = &prep->blocks[block];
+		if (len && addr >= blk->addr && addr - blk->addr + (uint64_t)len <= blk->len)
+			break;
+	}
+
+	if (block == prep->num_blocks)
+		return -1;
+
+	for (uint32_t i = 0; i < prep->num_patches; i++) {
+		patch = &prep->patches[i];
+		if (addr < patch->addr + patch->len && patch->addr < addr + len)
+			return -1;
+	}
+
+	/* Packets the patch falls in, merged with any segment they touch */
+	start = prep_packet_off(blk, addr - blk->addr);
+	end = prep_packet_off(blk, addr - blk->addr + len - 1) + PREP_BLOCK_SIZE +
+	      FINE_FRAME_OVERHEAD;
+	if (end > blk->frame_off + blk->frame_len)
+		end = blk->frame_off + blk->frame_len;
+
+	for (uint32_t i = 0; i < prep->num_segments;) {
+		seg = &prep->segments[i];
+
+		if (seg->block != block || seg->frame_off + seg->frame_len <= start ||
+		    end <= seg->frame_off) {
+			i++;
+			continue;
+		}
+
+		if (seg->frame_off < start)
+			start = seg->frame_off;
+		if (seg->frame_off + seg->frame_len > end)
+			end = seg->frame_off + seg->frame_len;
+
+		free(seg->frames);
+		*seg = prep->segments[--prep->num_segments];
+	}
+
+	patch = realloc(prep->patches, (prep->num_patches + 1) * sizeof(*patch));
+	if (!patch)
+		return -1;
+	prep->patches = patch;
+
+	seg = realloc(prep->segments, (prep->num_segments + 1) * sizeof(*seg));
+	if (!seg)
+		return -1;
+	prep->segments = seg;
+
+	seg = &prep->segments[prep->num_segments];
+	seg->block = block;
+	seg->frame_off = start;
+	seg->frame_len = end - start;
+	seg->frames = malloc(seg->frame_len);
+
+	patch = &prep->patches[prep->num_patches];
+	patch->addr = addr;
+	patch->len = len;
+	patch->block = block;
+	patch->value = malloc(len);
+
+	if (!seg->frames || !patch->value) {
+		free(seg->frames);
+		free(patch->value);
+		return -1;
+	}
+
+	/* No value is set yet: the copy is the image itself */
+	memcpy(seg->frames, &prep->frames[start], seg->frame_len);
+	memcpy(patch->value, &prep->data[blk->data_off + addr - blk->addr], len);
+
+	prep->num_segments++;
+	qsort(prep->segments, prep->num_segments, sizeof(*prep->segments), segment_cmp);
+
+	return prep->num_patches++;
+}
+
+/* Rewrite the patched bytes in the segment and take the difference off
+ * the packet sum, rather than summing the packet again.
+ */
+void prep_set_patch(struct prep_image *prep, int index, const uint8_t *value)
+{
+	struct prep_patch *patch = &prep->patches[index];
+	const struct prep_block *blk = &prep->blocks[patch->block];
+	uint32_t first = prep_packet_off(blk, patch->addr - blk->addr);
+	const struct prep_segment *seg = NULL;
+	uint8_t *frames;
+
+	for (uint32_t i = 0; i < prep->num_segments; i++) {
+		seg = &prep->segments[i];
+		if (seg->block == patch->block && first >= seg->frame_off &&
+		    first < seg->frame_off + seg->frame_len)
+			break;
+	}
+
+	frames = seg->frames - seg->frame_off;
+
+	for (uint32_t i = 0; i < patch->len; i++) {
+		uint32_t off = patch->addr - blk->addr + i;
+		uint32_t packet = prep_packet_off(blk, off);
+		uint32_t n = blk->len - off / PREP_BLOCK_SIZE * PREP_BLOCK_SIZE;
+
+		if (n > PREP_BLOCK_SIZE)
+			n = PREP_BLOCK_SIZE;
+
+		/* Payload starts after SOH, length and command, sum follows */
+		frames[packet + 4 + off % PREP_BLOCK_SIZE] = value[i];
+		frames[packet + 4 + n] -= value[i] - patch->value[i];
+		patch->value[i] = value[i];
+	}
+}
+
+uint32_t prep_block_checksum(const struct prep_image *prep, uint32_t block)
+{
+	const struct prep_block *blk = &prep->blocks[block];
+	const uint8_t *data = &prep->data[blk->data_off];
+	uint32_t pos = blk->addr;
+	uint64_t hash = 0;
+	bool patched = false;
+
+	/* Hash the data between patches, and patch values in their place */
+	for (;;) {
+		const struct prep_patch *next = NULL;
+
+		for (uint32_t i = 0; i < prep->num_patches; i++) {
+			const struct prep_patch *patch = &prep->patches[i];
+
+			if (patch->block == block && patch->addr >= pos &&
+			    (!next || patch->addr < next->addr))
+				next = patch;
+		}
+
+		if (!next)
+			break;
+
+		hash = prep_hash(hash, &data[pos - blk->addr], next->addr - pos);
+		hash = prep_hash(hash, next->value, next->len);
+		pos = next->addr + next->len;
+		patched = true;
+	}
+
+	if (!patched)
+		return blk->checksum;
+
+	return (uint32_t)prep_hash(hash, &data[pos - blk->addr], blk->addr + blk->len - pos);
+}
+
+void prep_copy_data(const struct prep_image *prep, uint32_t block, uint32_t off,
+		    uint8_t *buf, uint32_t len)
+{
+	const struct prep_block *blk = &prep->blocks[block];
+	uint32_t addr = blk->addr + off;
+
+	memcpy(buf, &prep->data[blk->data_off + off], len);
+
+	for (uint32_t i = 0; i < prep->num_patches; i++) {
+		const struct prep_patch *patch = &prep->patches[i];
+		uint32_t start, end;
+
+		if (patch->block != block || patch->addr >= addr + len ||
+		    patch->addr + patch->len <= addr)
+			continue;
+
+		start = patch->addr > addr ? patch->addr : addr;
+		end = patch->addr + patch->len < addr + len ? patch->addr + patch->len :
+							       addr + len;
+		memcpy(&buf[start - addr], &patch->value[start - patch->addr], end - start);
+	}
+}
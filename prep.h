@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREP_H
+#define PREP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PREP_BLOCK_SIZE			1024
+#define PREP_ERASED			0xFF
+
+struct image;
+
+/* One write command. Offsets are into prep_image data and frames, so
+ * the block table can be used straight from a mapped cache file.
+ */
+struct prep_block {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t data_off;
+	uint32_t frame_off;
+	uint32_t frame_len;
+	uint32_t checksum;		/* FNV-1a of the block data */
+};
+
+/* Per-unit value (serial number, MAC address, calibration) written over
+ * the image at send time. Packets holding patched bytes are copied once
+ * into segments, as the frames may be a read-only mapping; setting a
+ * value then only rewrites those bytes in the copy.
+ */
+struct prep_patch {
+	uint32_t addr;
+	uint32_t len;
+	uint32_t block;
+	uint8_t *value;			/* current value, image data until set */
+};
+
+struct prep_segment {
+	uint32_t block;
+	uint32_t frame_off;		/* copied range of frames */
+	uint32_t frame_len;
+	uint8_t *frames;
+};
+
+/* An image ready to send: padded to PREP_BLOCK_SIZE, erased blocks
+ * dropped, data packets framed by fine_frame_packet().
+ */
+struct prep_image {
+	uint32_t num_blocks;
+	struct prep_block *blocks;
+	uint8_t *data;
+	uint8_t *frames;
+	uint32_t data_len;
+	uint32_t frames_len;
+
+	void *map;			/* set when backed by a cache file */
+	size_t map_len;
+
+	uint32_t num_patches;
+	struct prep_patch *patches;
+	uint32_t num_segments;		/* sorted by block, then frames */
+	struct prep_segment *segments;
+};
+
+int prep_build(struct prep_image *prep, struct image *image);
+int prep_build_raw(struct prep_image *prep, uint32_t addr, const uint8_t *data,
+		   uint32_t len);
+void prep_free(struct prep_image *prep);
+
+/* Load firmware through the cache in cache_dir (NULL disables it). The
+ * key is a hash of the file content, base address and block geometry.
+ */
+int prep_load(struct prep_image *prep, const char *path, const uint32_t *base_addr,
+	      const char *cache_dir);
+
+uint64_t prep_hash(uint64_t hash, const void *buf, size_t len);
+
+/* Declare a patch region, all patches before any value is set. Returns
+ * the patch index, or -1 when the range is not within one block or
+ * overlaps another patch.
+ */
+int prep_add_patch(struct prep_image *prep, uint32_t addr, uint32_t len);
+void prep_set_patch(struct prep_image *prep, int index, const uint8_t *value);
+
+/* Checksum of a block as currently patched */
+uint32_t prep_block_checksum(const struct prep_image *prep, uint32_t block);
+
+/* Copy len bytes of a block from offset off, as currently patched */
+void prep_copy_data(const struct prep_image *prep, uint32_t block, uint32_t off,
+		    uint8_t *buf, uint32_t len);
+
+#endif /* PREP_H */
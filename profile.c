@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "fine.h"
+#include "transport.h"
+#include "job.h"
+#include "profile.h"
+
+/* Exchange sizes tried, in words; 0 stands for the largest of the path */
+static const uint32_t bench_words[] = { 4, 8, 16, 32, 64, 0 };
+
+#define BENCH_NUM_SIZES			(sizeof(bench_words) / sizeof(bench_words[0]))
+
+enum bench_path {
+	BENCH_SEND,
+	BENCH_RECV,
+	BENCH_NUM_PATHS,
+};
+
+static const char * const path_names[BENCH_NUM_PATHS] = {
+	[BENCH_SEND]	= "send",
+	[BENCH_RECV]	= "receive",
+};
+
+/* Counts the exchanges of the steps timed, in front of the target */
+struct bench_counter {
+	struct fine_transport t;
+	struct fine_transport *inner;
+	uint64_t exchanges;
+	uint64_t usb_bytes;
+	uint64_t io_ns;
+};
+
+struct bench_result {
+	uint32_t words;
+	uint64_t ns;			/* steps of the path */
+	uint64_t io_ns;			/* exchanges alone */
+	uint64_t exchanges;
+	uint64_t usb_bytes;
+	uint64_t bytes;			/* target memory written or read */
+};
+
+/* What the queue limits gave before profiles: 64 transactions, i.e. 32
+ * packet words with their acks, and a full buffer of data words.
+ */
+void profile_init(struct fine_profile *profile)
+{
+	profile->send_words = 32;
+	profile->recv_words = PROFILE_RECV_WORDS_MAX;
+}
+
+static int profile_parse_u32(const char *s, uint32_t *val)
+{
+	char *end;
+	unsigned long v;
+
+	/* strtoul() takes "-1" as ULONG_MAX */
+	if (*s == '-')
+		return EXIT_FAILURE;
+
+	errno = 0;
+	v = strtoul(s, &end, 0);
+	if (*end || end == s || errno == ERANGE || v > UINT32_MAX)
+		return EXIT_FAILURE;
+
+	*val = v;
+
+	return EXIT_SUCCESS;
+}
+
+int profile_load(struct fine_profile *profile, const char *path)
+{
+	char line[256];
+	int lineno = 0;
+	FILE *f;
+
+	profile_init(profile);
+
+	f = fopen(path, "r");
+	if (!f) {
+		LOG_ERROR("Can't open profile %s", path);
+		return EXIT_FAILURE;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char key[32], sa[32];
+		uint32_t a = 0;
+		char *hash;
+		int n;
+
+		lineno++;
+
+		hash = strchr(line, '#');
+		if (hash)
+			*hash = '\0';
+
+		n = sscanf(line, "%31s %31s", key, sa);
+		if (n <= 0)
+			continue;
+
+		if (n == 2 && profile_parse_u32(sa, &a))
+			n = 0;		/* not a number: an invalid line */
+
+		if (n == 2 && !strcmp(key, "send_words") && a &&
+		    a <= PROFILE_SEND_WORDS_MAX) {
+			profile->send_words = a;
+		} else if (n == 2 && !strcmp(key, "recv_words") && a &&
+			   a <= PROFILE_RECV_WORDS_MAX) {
+			profile->recv_words = a;
+		} else {
+			LOG_ERROR("%s:%d: invalid line", path, lineno);
+			fclose(f);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fclose(f);
+
+	return EXIT_SUCCESS;
+}
+
+int profile_save(const struct fine_profile *profile, const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f) {
+		LOG_ERROR("Can't write profile %s", path);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(f, "send_words %-5" PRIu32 "# of %d\n", profile->send_words,
+		PROFILE_SEND_WORDS_MAX);
+	fprintf(f, "recv_words %-5" PRIu32 "# of %d\n", profile->recv_words,
+		PROFILE_RECV_WORDS_MAX);
+
+	if (fclose(f)) {
+		LOG_ERROR("Can't write profile %s", path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int bench_counter_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+			    uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct bench_counter *c = t->priv;
+	uint64_t start = transport_now_ns(c->inner);
+	int ret;
+
+	ret = c->inner->io(c->inner, out, in, out_len, in_len, timeout);
+
+	c->io_ns += transport_now_ns(c->inner) - start;
+	c->exchanges++;
+	c->usb_bytes += out_len + in_len;
+
+	return ret;
+}
+
+static uint64_t bench_counter_now(struct fine_transport *t)
+{
+	struct bench_counter *c = t->priv;
+
+	return transport_now_ns(c->inner);
+}
+
+static int bench_path(enum job_step_type type)
+{
+	switch (type) {
+	case JOB_PROGRAM:
+	case JOB_OPTION:
+		return BENCH_SEND;
+	case JOB_VERIFY:
+	case JOB_READ:
+		return BENCH_RECV;
+	default:
+		return -1;
+	}
+}
+
+/* Target memory a step moves: its image, the images verified, or the
+ * range read.
+ */
+static uint64_t bench_step_bytes(const struct job *job, const struct job_step *step)
+{
+	uint64_t bytes = 0;
+
+	switch (step->type) {
+	case JOB_PROGRAM:
+	case JOB_OPTION:
+		for (uint32_t i = 0; i < step->prep.num_blocks; i++)
+			bytes += step->prep.blocks[i].len;
+		return bytes;
+
+	case JOB_VERIFY:
+		for (const struct job_step *p = job->steps; p < step; p++) {
+			if (p->type == JOB_PROGRAM || p->type == JOB_OPTION)
+				bytes += bench_step_bytes(job, p);
+		}
+		return bytes;
+
+	case JOB_READ:
+		return buf_get_u32_be(step->req, 4);
+
+	default:
+		return 0;
+	}
+}
+
+static void bench_report(enum bench_path path, const struct bench_result *res, int best)
+{
+	printf("%-7s %5s %9s %9s %9s %10s\n", path_names[path], "words", "exchanges",
+		"rtt (us)", "bytes/ex", "KiB/s");
+
+	for (size_t i = 0; i < BENCH_NUM_SIZES; i++) {
+		const struct bench_result *r = &res[i];
+
+		if (!r->exchanges)
+			continue;
+
+		printf("%-7s %5" PRIu32 " %9" PRIu64 " %9.1f %9.1f %10.1f%s\n", "",
+			r->words, r->exchanges, r->io_ns / 1e3 / r->exchanges,
+			(double)r->usb_bytes / r->exchanges,
+			r->ns ? r->bytes * 1e9 / r->ns / 1024 : 0.0,
+			(int)i == best ? "  *" : "");
+	}
+}
+
+int profile_bench(struct fine_session *s, struct job *job, struct fine_profile *best)
+{
+	struct bench_result res[BENCH_NUM_PATHS][BENCH_NUM_SIZES] = { 0 };
+	struct fine_transport *inner = fine_get_transport(s);
+	struct bench_counter c = { 0 };
+	struct fine_profile profile;
+	int first = -1;
+	int ret;
+
+	for (int i = 0; i < job->num_steps && first < 0; i++) {
+		if (job->steps[i].type == JOB_ERASE)
+			first = i;
+	}
+
+	if (first < 0) {
+		LOG_ERROR("%s: the benchmark repeats the job from its first erase, none found",
+			  job->path);
+		return EXIT_FAILURE;
+	}
+
+	profile_init(best);
+	fine_set_profile(s, best);
+
+	ret = job_run_steps(job, s, 0, first);
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	/* Lives on the stack: the session gets its transport back below */
+	c.t.name = inner->name;
+	c.t.io = bench_counter_io;
+	c.t.now = bench_counter_now;
+	c.t.priv = &c;
+	c.inner = inner;
+	fine_set_transport(s, &c.t);
+
+	/* Both paths are swept at once, they don't share exchanges */
+	for (size_t k = 0; k < BENCH_NUM_SIZES && ret == EXIT_SUCCESS; k++) {
+		profile.send_words = bench_words[k] ? bench_words[k] : PROFILE_SEND_WORDS_MAX;
+		profile.recv_words = bench_words[k] ? bench_words[k] : PROFILE_RECV_WORDS_MAX;
+		fine_set_profile(s, &profile);
+
+		printf("Benchmark: %" PRIu32 "/%" PRIu32 " words per exchange\n",
+			profile.send_words, profile.recv_words);
+
+		for (int i = first; i < job->num_steps && ret == EXIT_SUCCESS; i++) {
+			const struct job_step *step = &job->steps[i];
+			struct bench_counter before = c;
+			uint64_t start = fine_now_ns(s);
+			struct bench_result *r;
+			int path;
+
+			ret = job_run_steps(job, s, i, 1);
+
+			path = bench_path(step->type);
+			if (path < 0)
+				continue;
+
+			r = &res[path][k];
+			r->words = path == BENCH_SEND ? profile.send_words : profile.recv_words;
+			r->ns += fine_now_ns(s) - start;
+			r->io_ns += c.io_ns - before.io_ns;
+			r->exchanges += c.exchanges - before.exchanges;
+			r->usb_bytes += c.usb_bytes - before.usb_bytes;
+			r->bytes += bench_step_bytes(job, step);
+		}
+	}
+
+	fine_set_transport(s, inner);
+
+	if (ret != EXIT_SUCCESS)
+		return ret;
+
+	for (int path = 0; path < BENCH_NUM_PATHS; path++) {
+		int fastest = -1;
+
+		for (size_t k = 0; k < BENCH_NUM_SIZES; k++) {
+			const struct bench_result *r = &res[path][k];
+
+			/* Same bytes in every run: the shortest wins */
+			if (r->exchanges && (fastest < 0 || r->ns < res[path][fastest].ns))
+				fastest = k;
+		}
+
+		if (fastest < 0) {
+			LOG_WARNING("%s: no %s step, keeping the default", job->path,
+				    path_names[path]);
+			continue;
+		}
+
+		bench_report(path, res[path], fastest);
+
+		if (path == BENCH_SEND)
+			best->send_words = res[path][fastest].words;
+		else
+			best->recv_words = res[path][fastest].words;
+	}
+
+	printf("Fastest: send %" PRIu32 " words, receive %" PRIu32 " words per exchange\n",
+		best->send_words, best->recv_words);
+
+	fine_set_profile(s, best);
+
+	return EXIT_SUCCESS;
+}
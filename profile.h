@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include "transport.h"
+
+struct job;
+struct fine_session;
+
+/* Largest exchanges of each path: a packet word and its ack take six
+ * bytes out, a target data word five bytes in.
+ */
+#define PROFILE_SEND_WORDS_MAX		(FINE_QUEUE_OUT_MAX / 6)
+#define PROFILE_RECV_WORDS_MAX		(FINE_QUEUE_IN_MAX / 5)
+
+/* Probe profile: FINE words per exchange when sending a packet (write
+ * data, stub blocks) and when reading one (read, verify). Profile files
+ * have one parameter per line, `#` starts a comment:
+ *
+ *   send_words 32
+ *   recv_words 102
+ */
+struct fine_profile {
+	uint32_t send_words;
+	uint32_t recv_words;
+};
+
+void profile_init(struct fine_profile *profile);
+int profile_load(struct fine_profile *profile, const char *path);
+int profile_save(const struct fine_profile *profile, const char *path);
+
+/* Characterise the target: run the job's setup steps once, then its
+ * steps from the first erase on for a range of exchange sizes, timing
+ * the send and receive paths. Prints the latency and throughput curve
+ * of each path and returns the fastest sizes in best, which the session
+ * keeps.
+ */
+int profile_bench(struct fine_session *s, struct job *job, struct fine_profile *best);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,789 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Simulated target for running jobs without hardware. It decodes the
+ * FINE sub-command stream the way the J-Link and the RX boot firmware
+ * do, as far as fine.c uses them:
+ *
+ *   9D 43 75 C0   start sequence, answers 23 02
+ *   C2            chip ID, 2 bytes
+ *   88 xx xx      configuration, no answer
+ *   84 b0 b1 b2 b3  four bytes of host packet, 1 byte answer
+ *   C4            target data: 1 status byte, then 4 bytes of the
+ *                 pending target packet when 5 bytes are read
+ *   C6            ack, answers 00 00
+ *
+ * Host packets are SOH/SOD, length, command, data, sum, ETX; target
+ * packets are built the same way and padded to whole words.
+ *
+ * Optionally the boot firmware accepts a flash stub into RAM. The stub
+ * code is only stored; once "run", its behaviour is modelled here: boot
+ * commands keep working and compressed stub writes are programmed.
+ *
+ * Every exchange also counts the work it gives the probe and the target
+ * (struct model_work). With a timing model set, that work is turned
+ * into time: either slept, so the simulator runs at the speed of a real
+ * board, or added to a virtual clock for dry runs.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "fine.h"
+#include "transport.h"
+#include "model.h"
+#include "lz.h"
+#include "sim.h"
+
+#define SIM_CHIP_ID			0x6505
+#define SIM_MAX_AREAS			FINE_MAX_AREAS
+#define SIM_RAM_SIZE			0x40000	/* at address 0 */
+
+
+struct sim_area {
+	uint8_t koa;
+	uint32_t sad;
+	uint32_t ead;
+	uint32_t eau;
+	uint32_t wau;
+	uint8_t *mem;
+};
+
+struct sim {
+	struct fine_transport t;
+
+	bool started;
+	bool initialized;
+
+	struct sim_area areas[SIM_MAX_AREAS];
+	int num_areas;
+
+	/* host packet being received, up to a stub write */
+	uint8_t rx[FINE_STUB_MAX_DATA_LEN + FINE_FRAME_OVERHEAD];
+	uint32_t rx_len;
+
+	/* target packet being sent */
+	uint8_t tx[FINE_MAX_RESP_LEN + 8];
+	uint32_t tx_len;
+	uint32_t tx_pos;
+
+	/* data phase of the last command */
+	uint8_t data_cmd;
+	uint8_t data[32];
+	int data_len;
+
+	/* write or read in progress */
+	uint8_t xfer_cmd;
+	uint32_t xfer_addr;
+	uint32_t xfer_end;
+	struct sim_area *xfer_area;
+
+	uint32_t sys_clk;
+	uint32_t bitrate;
+
+	/* flash stub */
+	bool stub_enabled;
+	bool stub_running;
+	uint8_t *ram;
+	uint32_t stub_end;		/* stub loaded below this address */
+	uint8_t stub_block[FINE_STUB_BLOCK];
+
+	/* work of the current exchange, and its cost with a timing model */
+	struct model_work work;
+	const struct fine_model *model;
+	bool realtime;
+	uint64_t clock_ns;
+	uint64_t cost[MODEL_NUM_COSTS];
+
+	/* hot-plug: a board is present when attached is set, or for
+	 * present_ms out of every absent_ms + present_ms when cycling
+	 */
+	bool attached;
+	uint32_t absent_ms;
+	uint32_t present_ms;
+	uint64_t plug_start_ns;
+};
+
+static const struct {
+	uint8_t koa;
+	uint32_t sad;
+	uint32_t ead;
+	uint32_t eau;
+	uint32_t wau;
+} sim_layout[] = {
+	{ 0x00, 0xFFE00000, 0xFFFFFFFF, 0x8000, 0x80 },	/* code flash */
+	{ 0x01, 0x00100000, 0x00107FFF, 0x40,   0x4 },	/* data flash */
+	{ 0x02, 0xFE7F5D00, 0xFE7F5D7F, 0x80,   0x4 },	/* config area */
+};
+
+static void sim_reply(struct sim *sim, uint8_t res, const uint8_t *data, int len)
+{
+	uint8_t sum = 0;
+	uint32_t n = 0;
+
+	sim->tx[n++] = 0x81;
+	sim->tx[n++] = (len + 1) >> 8;
+	sim->tx[n++] = (len + 1) & 0xFF;
+	sim->tx[n++] = res;
+	if (len)
+		memcpy(&sim->tx[n], data, len);
+	n += len;
+
+	for (uint32_t i = 1; i < n; i++)
+		sum += sim->tx[i];
+	sim->tx[n++] = ~sum + 1;
+	sim->tx[n++] = FINE_CMD_ETX;
+
+	while (n % 4)
+		sim->tx[n++] = 0;
+
+	sim->tx_len = n;
+	sim->tx_pos = 0;
+}
+
+static void sim_status(struct sim *sim, uint8_t cmd, uint8_t err)
+{
+	if (err)
+		sim_reply(sim, cmd | 0x80, &err, 1);
+	else
+		sim_reply(sim, cmd, NULL, 0);
+}
+
+static struct sim_area *sim_find_area(struct sim *sim, uint32_t sad, uint32_t ead)
+{
+	for (int i = 0; i < sim->num_areas; i++) {
+		if (sad >= sim->areas[i].sad && ead <= sim->areas[i].ead && sad <= ead)
+			return &sim->areas[i];
+	}
+
+	return NULL;
+}
+
+static void sim_set_data(struct sim *sim, uint8_t cmd, const uint8_t *data,
+			 int len)
+{
+	memcpy(sim->data, data, len);
+	sim->data_len = len;
+	sim->data_cmd = cmd;
+}
+
+/* Flash can only clear bits */
+static void sim_program(struct sim *sim, struct sim_area *area, uint32_t addr,
+			const uint8_t *data, uint32_t len)
+{
+	uint8_t *mem = &area->mem[addr - area->sad];
+
+	for (uint32_t i = 0; i < len; i++)
+		mem[i] &= data[i];
+
+	if (area->koa < MODEL_MAX_KOA)
+		sim->work.program_units[area->koa] += len / area->wau;
+}
+
+static uint8_t sim_stub_write(struct sim *sim, const uint8_t *req, uint32_t len)
+{
+	uint8_t *block = sim->stub_block;
+	uint32_t sad, n;
+	struct sim_area *area;
+	int32_t got;
+
+	if (len < FINE_STUB_HDR_LEN)
+		return FINE_CMD_ERR_PACKET;
+
+	sad = buf_get_u32_be(req, 0);
+	n = buf_get_u32_be(req, 4);
+	if (!n || n > FINE_STUB_BLOCK)
+		return FINE_CMD_ERR_PACKET;
+
+	area = sim_find_area(sim, sad, sad + n - 1);
+	if (!area || ((sad - area->sad) % area->wau) || (n % area->wau))
+		return FINE_CMD_ERR_ADDRESS;
+
+	req += FINE_STUB_HDR_LEN;
+	len -= FINE_STUB_HDR_LEN;
+
+	switch (req[-1]) {
+	case FINE_STUB_RAW:
+		got = len;
+		memcpy(block, req, len < n ? len : n);
+		break;
+	case FINE_STUB_LZ:
+		got = lz_decompress(req, len, block, n);
+		break;
+	default:
+		return FINE_CMD_ERR_PACKET;
+	}
+
+	if (got != (int32_t)n)
+		return FINE_CMD_ERR_PACKET;
+
+	sim_program(sim, area, sad, block, n);
+
+	return 0;
+}
+
+static uint8_t sim_range_cmd(struct sim *sim, uint8_t cmd, const uint8_t *req)
+{
+	uint32_t sad = buf_get_u32_be(req, 0);
+	uint32_t ead = buf_get_u32_be(req, 4);
+	struct sim_area *area = sim_find_area(sim, sad, ead);
+	uint32_t unit;
+
+	if (cmd == FINE_CMD_STUB_LOAD) {
+		if (sad > ead || ead >= SIM_RAM_SIZE)
+			return FINE_CMD_ERR_ADDRESS;
+		sim->xfer_cmd = cmd;
+		sim->xfer_addr = sad;
+		sim->xfer_end = ead;
+		sim->stub_end = 0;
+		return 0;
+	}
+
+	if (!area)
+		return FINE_CMD_ERR_ADDRESS;
+
+	unit = cmd == FINE_CMD_ERASE ? area->eau : area->wau;
+	if (cmd != FINE_CMD_READ &&
+	    (((sad - area->sad) % unit) || ((ead - area->sad + 1) % unit)))
+		return FINE_CMD_ERR_ADDRESS;
+
+	if (cmd == FINE_CMD_ERASE) {
+		memset(&area->mem[sad - area->sad], 0xFF, ead - sad + 1);
+		if (area->koa < MODEL_MAX_KOA)
+			sim->work.erase_units[area->koa] += (ead - sad + 1) / area->eau;
+		return 0;
+	}
+
+	sim->xfer_cmd = cmd;
+	sim->xfer_addr = sad;
+	sim->xfer_end = ead;
+	sim->xfer_area = area;
+
+	return 0;
+}
+
+static void sim_command(struct sim *sim, uint8_t cmd, const uint8_t *req, int len)
+{
+	const struct fine_cmd_desc *desc = fine_cmd_lookup(cmd);
+	uint8_t resp[24];
+	uint8_t err = 0;
+
+	sim->data_len = 0;
+	sim->xfer_cmd = 0;
+
+	if (sim->work.num_cmds < MODEL_MAX_CMDS)
+		sim->work.cmds[sim->work.num_cmds++] = cmd;
+
+	if (!desc || (cmd == FINE_CMD_STUB_WRITE && !sim->stub_running) ||
+	    ((cmd == FINE_CMD_STUB_LOAD || cmd == FINE_CMD_STUB_RUN) &&
+	     (!sim->stub_enabled || sim->stub_running))) {
+		sim_status(sim, cmd, FINE_CMD_ERR_NOT_SUPPORTED);
+		return;
+	}
+
+	if (cmd == FINE_CMD_STUB_WRITE) {
+		sim_status(sim, cmd, sim_stub_write(sim, req, len));
+		return;
+	}
+
+	if (len != desc->req_len) {
+		sim_status(sim, cmd, FINE_CMD_ERR_PACKET);
+		return;
+	}
+
+	switch (cmd) {
+	case FINE_CMD_GET_AUTH_MODE:
+		resp[0] = 0;
+		sim_set_data(sim, cmd, resp, 1);
+		break;
+	case FINE_CMD_SET_FREQUENCY:
+		sim->sys_clk = buf_get_u32_be(req, 4);
+		buf_set_u32_be(resp, 0, sim->sys_clk);
+		buf_set_u32_be(resp, 4, sim->sys_clk / 2);
+		sim_set_data(sim, cmd, resp, 8);
+		break;
+	case FINE_CMD_SET_BITRATE:
+		if (!sim->sys_clk || !buf_get_u32_be(req, 0))
+			err = FINE_CMD_ERR_BIT_RATE;
+		else
+			sim->bitrate = buf_get_u32_be(req, 0);
+		break;
+	case FINE_CMD_GET_DEVICE_TYPE:
+		memcpy(resp, "R5F565NE", 8);
+		buf_set_u32_be(resp, 8, 24000000);
+		buf_set_u32_be(resp, 12, 8000000);
+		buf_set_u32_be(resp, 16, 120000000);
+		buf_set_u32_be(resp, 20, 32768);
+		sim_set_data(sim, cmd, resp, 24);
+		break;
+	case FINE_CMD_GET_AREA_COUNT:
+		resp[0] = sim->num_areas;
+		sim_set_data(sim, cmd, resp, 1);
+		break;
+	case FINE_CMD_GET_AREA_INFO:
+		if (req[0] >= sim->num_areas) {
+			err = FINE_CMD_ERR_AREA;
+			break;
+		}
+		resp[0] = sim->areas[req[0]].koa;
+		buf_set_u32_be(resp, 1, sim->areas[req[0]].sad);
+		buf_set_u32_be(resp, 5, sim->areas[req[0]].ead);
+		buf_set_u32_be(resp, 9, sim->areas[req[0]].eau);
+		buf_set_u32_be(resp, 13, sim->areas[req[0]].wau);
+		sim_set_data(sim, cmd, resp, 17);
+		break;
+	case FINE_CMD_ERASE:
+	case FINE_CMD_WRITE:
+	case FINE_CMD_READ:
+	case FINE_CMD_STUB_LOAD:
+		err = sim_range_cmd(sim, cmd, req);
+		break;
+	case FINE_CMD_STUB_RUN:
+		if (!sim->stub_end || buf_get_u32_be(req, 0) >= sim->stub_end)
+			err = FINE_CMD_ERR_ADDRESS;
+		else
+			sim->stub_running = true;
+		break;
+	default:
+		break;
+	}
+
+	sim_status(sim, cmd, err);
+}
+
+/* SOD packet: write data or a request for the data phase */
+static void sim_data_packet(struct sim *sim, uint8_t cmd, const uint8_t *data, int len)
+{
+	struct sim_area *area = sim->xfer_area;
+	uint32_t left = sim->xfer_end - sim->xfer_addr + 1;
+
+	if (sim->xfer_cmd == FINE_CMD_STUB_LOAD && cmd == FINE_CMD_STUB_LOAD) {
+		if (!len || (uint32_t)len > left) {
+			sim_status(sim, cmd, FINE_CMD_ERR_PACKET);
+			return;
+		}
+
+		memcpy(&sim->ram[sim->xfer_addr], data, len);
+		sim->xfer_addr += len;
+		if ((uint32_t)len == left) {
+			sim->xfer_cmd = 0;
+			sim->stub_end = sim->xfer_addr;
+		}
+
+		sim_status(sim, cmd, 0);
+		return;
+	}
+
+	if (sim->xfer_cmd == FINE_CMD_WRITE && cmd == FINE_CMD_WRITE) {
+		if (!len || (uint32_t)len > left) {
+			sim_status(sim, cmd, FINE_CMD_ERR_PACKET);
+			return;
+		}
+
+		sim_program(sim, area, sim->xfer_addr, data, len);
+
+		sim->xfer_addr += len;
+		if ((uint32_t)len == left)
+			sim->xfer_cmd = 0;
+
+		sim_status(sim, cmd, 0);
+		return;
+	}
+
+	if (sim->xfer_cmd == FINE_CMD_READ && cmd == FINE_CMD_READ) {
+		uint32_t n = left > FINE_MAX_DATA_LEN ? FINE_MAX_DATA_LEN : left;
+
+		sim_reply(sim, cmd, &area->mem[sim->xfer_addr - area->sad], n);
+
+		sim->xfer_addr += n;
+		if (n == left)
+			sim->xfer_cmd = 0;
+		return;
+	}
+
+	if (sim->data_len && sim->data_cmd == cmd) {
+		sim_reply(sim, cmd, sim->data, sim->data_len);
+		sim->data_len = 0;
+		return;
+	}
+
+	sim_status(sim, cmd, FINE_CMD_ERR_FLOW);
+}
+
+static void sim_packet(struct sim *sim)
+{
+	uint32_t len = (sim->rx[1] << 8) | sim->rx[2];
+	uint8_t cmd = sim->rx[3];
+	uint8_t sum = 0;
+
+	for (uint32_t i = 1; i < len + 4; i++)
+		sum += sim->rx[i];
+
+	if (sum) {
+		sim_status(sim, cmd, FINE_CMD_ERR_CHECKSUM);
+		return;
+	}
+
+	if (sim->rx[len + 4] != FINE_CMD_ETX) {
+		sim_status(sim, cmd, FINE_CMD_ERR_PACKET);
+		return;
+	}
+
+	if (sim->rx[0] == FINE_CMD_SOH)
+		sim_command(sim, cmd, &sim->rx[4], len - 1);
+	else
+		sim_data_packet(sim, cmd, &sim->rx[4], len - 1);
+}
+
+static void sim_receive(struct sim *sim, const uint8_t *buf, int len)
+{
+	for (int i = 0; i < len; i++) {
+		/* Padding after ETX */
+		if (!sim->rx_len && buf[i] != FINE_CMD_SOH &&
+		    buf[i] != (FINE_CMD_SOH | PKT_STATUS))
+			continue;
+
+		sim->rx[sim->rx_len++] = buf[i];
+
+		if (sim->rx_len < 3)
+			continue;
+
+		uint32_t total = ((sim->rx[1] << 8) | sim->rx[2]) + 5;
+
+		if (total < 6 || total > sizeof(sim->rx)) {
+			sim_status(sim, 0, FINE_CMD_ERR_PACKET);
+			sim->rx_len = 0;
+		} else if (sim->rx_len == total) {
+			sim_packet(sim);
+			sim->rx_len = 0;
+		}
+	}
+}
+
+/* A new board: blank flash, boot firmware waiting for the start sequence */
+static void sim_plug(struct sim *sim, bool attached)
+{
+	if (attached == sim->attached)
+		return;
+
+	sim->attached = attached;
+	sim->started = false;
+	sim->initialized = false;
+	sim->rx_len = 0;
+	sim->tx_len = 0;
+	sim->data_len = 0;
+	sim->xfer_cmd = 0;
+	sim->sys_clk = 0;
+	sim->bitrate = 0;
+	sim->stub_running = false;
+	sim->stub_end = 0;
+
+	if (!attached)
+		return;
+
+	for (int i = 0; i < sim->num_areas; i++)
+		memset(sim->areas[i].mem, 0xFF,
+		       sim->areas[i].ead - sim->areas[i].sad + 1);
+}
+
+static void sim_update_plug(struct sim *sim)
+{
+	uint64_t period = (uint64_t)sim->absent_ms + sim->present_ms;
+	uint64_t phase;
+
+	if (!period)
+		return;
+
+	phase = ((monotonic_ns() - sim->plug_start_ns) / 1000000) % period;
+	sim_plug(sim, phase >= sim->absent_ms);
+}
+
+void sim_set_attached(struct fine_transport *t, bool attached)
+{
+	struct sim *sim = t->priv;
+
+	sim->absent_ms = 0;
+	sim->present_ms = 0;
+	sim_plug(sim, attached);
+}
+
+void sim_set_plug_cycle(struct fine_transport *t, uint32_t absent_ms,
+			uint32_t present_ms)
+{
+	struct sim *sim = t->priv;
+
+	sim->absent_ms = absent_ms;
+	sim->present_ms = present_ms;
+	sim->plug_start_ns = monotonic_ns();
+	sim_update_plug(sim);
+}
+
+void sim_set_stub(struct fine_transport *t, bool enabled)
+{
+	struct sim *sim = t->priv;
+
+	if (enabled && !sim->ram) {
+		sim->ram = calloc(1, SIM_RAM_SIZE);
+		if (!sim->ram)
+			return;
+	}
+
+	sim->stub_enabled = enabled;
+}
+
+static uint64_t sim_now(struct fine_transport *t)
+{
+	struct sim *sim = t->priv;
+
+	return sim->clock_ns;
+}
+
+void sim_set_model(struct fine_transport *t, const struct fine_model *model,
+		   bool realtime)
+{
+	struct sim *sim = t->priv;
+
+	sim->model = model;
+	sim->realtime = realtime;
+	t->now = model && !realtime ? sim_now : NULL;
+}
+
+void sim_get_work(struct fine_transport *t, struct model_work *work)
+{
+	struct sim *sim = t->priv;
+
+	*work = sim->work;
+}
+
+void sim_get_costs(struct fine_transport *t, uint64_t *cost)
+{
+	struct sim *sim = t->priv;
+
+	memcpy(cost, sim->cost, sizeof(sim->cost));
+}
+
+static void sim_charge(struct sim *sim)
+{
+	uint64_t ns = model_cost(sim->model, &sim->work, sim->cost);
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	sim->clock_ns += ns;
+
+	if (sim->realtime)
+		nanosleep(&ts, NULL);
+}
+
+static int sim_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+		  uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct sim *sim = t->priv;
+	uint32_t i = 0;
+	uint32_t n = 0;
+
+	(void)timeout;
+
+	memset(in, 0, in_len);
+
+	sim_update_plug(sim);
+
+	memset(&sim->work, 0, sizeof(sim->work));
+	sim->work.usb_bytes = out_len + in_len;
+	sim->work.link_bitrate = sim->bitrate;
+
+#define EMIT(b)	do { if (n < in_len) in[n] = (b); n++; } while (0)
+
+	while (i < out_len) {
+		switch (out[i]) {
+		case FINE_OP_START:
+			if (i + 4 > out_len || buf_get_u32_be(out, i) != FINE_START_SEQ)
+				goto bad_op;
+			i += 4;
+			if (!sim->attached) {
+				EMIT(0);
+				EMIT(0);
+				break;
+			}
+			sim->started = true;
+			sim->initialized = false;
+			sim->stub_running = false;
+			sim->rx_len = 0;
+			sim->tx_len = 0;
+			EMIT(0x23);
+			EMIT(0x02);
+			break;
+		case FINE_GET_CHIP_ID:
+			EMIT(sim->started ? SIM_CHIP_ID >> 8 : 0);
+			EMIT(sim->started ? SIM_CHIP_ID & 0xFF : 0);
+			i++;
+			break;
+		case FINE_OP_CONFIG:
+			i += 3;
+			break;
+		case FINE_ASK_TARGET_ACK:
+			EMIT(0);
+			EMIT(0);
+			i++;
+			break;
+		case FINE_OP_WRITE:
+			if (i + 5 > out_len)
+				goto bad_op;
+			if (sim->started && !sim->initialized && out[i + 1] == 0x55)
+				sim->initialized = true;
+			else if (sim->initialized) {
+				sim_receive(sim, &out[i + 1], 4);
+				sim->work.link_bytes += 4;
+			}
+			EMIT(0);
+			i += 5;
+			break;
+		case FINE_ASK_TARGET_DATA:
+			if (in_len - n < 5) {
+				EMIT(sim->initialized ? 0x00 : 0x0E);
+			} else {
+				EMIT(0);
+				sim->work.link_bytes += 4;
+				for (int k = 0; k < 4; k++) {
+					EMIT(sim->tx_pos < sim->tx_len ?
+					     sim->tx[sim->tx_pos] : 0);
+					sim->tx_pos++;
+				}
+			}
+			i++;
+			break;
+		default:
+			goto bad_op;
+		}
+	}
+
+#undef EMIT
+
+	if (n != in_len)
+		LOG_DEBUG("sim: %u answer bytes for %u requested", n, in_len);
+
+	if (sim->model)
+		sim_charge(sim);
+
+	return JAYLINK_OK;
+
+bad_op:
+	LOG_ERROR("sim: bad FINE sub-command 0x%02x at offset %u", out[i], i);
+	return JAYLINK_ERR_ARG;
+}
+
+static void sim_free(struct fine_transport *t)
+{
+	struct sim *sim = t->priv;
+
+	for (int i = 0; i < sim->num_areas; i++)
+		free(sim->areas[i].mem);
+
+	free(sim->ram);
+	free(sim);
+}
+
+struct fine_transport *sim_new(void)
+{
+	struct sim *sim = calloc(1, sizeof(*sim));
+
+	if (!sim)
+		return NULL;
+
+	sim->t.name = "sim";
+	sim->t.io = sim_io;
+	sim->t.free = sim_free;
+	sim->t.priv = sim;
+
+	for (size_t i = 0; i < sizeof(sim_layout) / sizeof(sim_layout[0]); i++) {
+		struct sim_area *area = &sim->areas[i];
+
+		area->koa = sim_layout[i].koa;
+		area->sad = sim_layout[i].sad;
+		area->ead = sim_layout[i].ead;
+		area->eau = sim_layout[i].eau;
+		area->wau = sim_layout[i].wau;
+		area->mem = malloc(area->ead - area->sad + 1);
+		if (!area->mem) {
+			sim_free(&sim->t);
+			return NULL;
+		}
+		memset(area->mem, 0xFF, area->ead - area->sad + 1);
+		sim->num_areas++;
+	}
+
+	sim->attached = true;
+
+	return &sim->t;
+}
+
+int sim_set_layout(struct fine_transport *t, const struct fine_mem_info *mem)
+{
+	struct sim *sim = t->priv;
+	struct sim_area areas[SIM_MAX_AREAS];
+	int num = 0;
+
+	if (mem->area_count > SIM_MAX_AREAS)
+		return EXIT_FAILURE;
+
+	for (; num < mem->area_count; num++) {
+		const struct fine_area_info *info = &mem->area[num];
+		struct sim_area *area = &areas[num];
+
+		if (info->koa >= MODEL_MAX_KOA || info->ead < info->sad ||
+		    !info->eau || !info->wau) {
+			LOG_ERROR("sim: can't model area 0x%08" PRIx32 "-0x%08" PRIx32,
+				  info->sad, info->ead);
+			goto err;
+		}
+
+		area->koa = info->koa;
+		area->sad = info->sad;
+		area->ead = info->ead;
+		area->eau = info->eau;
+		area->wau = info->wau;
+		area->mem = malloc((size_t)area->ead - area->sad + 1);
+		if (!area->mem)
+			goto err;
+		memset(area->mem, 0xFF, (size_t)area->ead - area->sad + 1);
+	}
+
+	for (int i = 0; i < sim->num_areas; i++)
+		free(sim->areas[i].mem);
+
+	memcpy(sim->areas, areas, num * sizeof(areas[0]));
+	sim->num_areas = num;
+
+	/* A transfer in progress was into the old areas */
+	sim->xfer_cmd = 0;
+	sim->xfer_area = NULL;
+
+	return EXIT_SUCCESS;
+
+err:
+	while (num--)
+		free(areas[num].mem);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct fine_transport;
+struct fine_model;
+struct fine_mem_info;
+struct model_work;
+
+/* Simulated RX65N in boot mode, behind a J-Link speaking FINE */
+struct fine_transport *sim_new(void);
+
+/* Replace the RX65N layout with the areas a board reported */
+int sim_set_layout(struct fine_transport *t, const struct fine_mem_info *mem);
+
+/* Hot-plug: either set the board presence directly, or let the board
+ * come and go, absent for absent_ms then present for present_ms.
+ */
+void sim_set_attached(struct fine_transport *t, bool attached);
+void sim_set_plug_cycle(struct fine_transport *t, uint32_t absent_ms,
+			uint32_t present_ms);
+
+/* Let the boot firmware load and run a flash stub. The stub is not
+ * executed: once started, the simulator answers as the stub would,
+ * decompressing and programming FINE_CMD_STUB_WRITE blocks.
+ */
+void sim_set_stub(struct fine_transport *t, bool enabled);
+
+/* Timing: with realtime set, each exchange sleeps for its cost in the
+ * model; otherwise the cost only advances the transport clock (dry run).
+ * Costs are accumulated by category, see enum model_cost.
+ */
+void sim_set_model(struct fine_transport *t, const struct fine_model *model,
+		   bool realtime);
+void sim_get_costs(struct fine_transport *t, uint64_t *cost);
+
+/* Work counted for the last exchange, for calibration */
+void sim_get_work(struct fine_transport *t, struct model_work *work);
+
+#endif /* SIM_H */
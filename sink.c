@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "prep.h"
+#include "sink.h"
+
+static int sink_mem_write(struct fine_sink *sink, const uint8_t *data, uint32_t len)
+{
+	struct fine_sink_mem *mem = (struct fine_sink_mem *)sink;
+
+	if (len > mem->size - mem->len) {
+		LOG_ERROR("FINE: response overflows its %u byte buffer", mem->size);
+		return EXIT_FAILURE;
+	}
+
+	memcpy(&mem->buf[mem->len], data, len);
+	mem->len += len;
+
+	return EXIT_SUCCESS;
+}
+
+void fine_sink_mem_init(struct fine_sink_mem *mem, void *buf, uint32_t size)
+{
+	mem->sink.write = sink_mem_write;
+	mem->sink.next = NULL;
+	mem->buf = buf;
+	mem->size = size;
+	mem->len = 0;
+}
+
+static int sink_fd_write(struct fine_sink *sink, const uint8_t *data, uint32_t len)
+{
+	struct fine_sink_fd *fd = (struct fine_sink_fd *)sink;
+
+	while (len) {
+		ssize_t n = write(fd->fd, data, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			LOG_ERROR("FINE: can't write response: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		data += n;
+		len -= n;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void fine_sink_fd_init(struct fine_sink_fd *fd, int fd_num)
+{
+	fd->sink.write = sink_fd_write;
+	fd->sink.next = NULL;
+	fd->fd = fd_num;
+}
+
+static int sink_sum_write(struct fine_sink *sink, const uint8_t *data, uint32_t len)
+{
+	struct fine_sink_sum *sum = (struct fine_sink_sum *)sink;
+
+	sum->hash = prep_hash(sum->hash, data, len);
+	sum->len += len;
+
+	return EXIT_SUCCESS;
+}
+
+void fine_sink_sum_init(struct fine_sink_sum *sum)
+{
+	sum->sink.write = sink_sum_write;
+	sum->sink.next = NULL;
+	sum->hash = 0;
+	sum->len = 0;
+}
+
+struct fine_sink *fine_sink_chain(struct fine_sink *sink, struct fine_sink *next)
+{
+	struct fine_sink *last = sink;
+
+	while (last->next)
+		last = last->next;
+	last->next = next;
+
+	return sink;
+}
+
+int fine_sink_write(struct fine_sink *sink, const uint8_t *data, uint32_t len)
+{
+	for (; sink; sink = sink->next) {
+		if (sink->write(sink, data, len) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
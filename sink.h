@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Destination of response payload. Sinks are embedded in the structs
+ * below and live on the caller's stack; next chains them, every sink
+ * of a chain sees the same bytes. write returns EXIT_SUCCESS or
+ * EXIT_FAILURE, e.g. when a memory span is full.
+ */
+struct fine_sink {
+	int (*write)(struct fine_sink *sink, const uint8_t *data, uint32_t len);
+	struct fine_sink *next;
+};
+
+struct fine_sink_mem {
+	struct fine_sink sink;
+	uint8_t *buf;
+	uint32_t size;
+	uint32_t len;
+};
+
+struct fine_sink_fd {
+	struct fine_sink sink;
+	int fd;
+};
+
+/* FNV-1a, as prep_hash(); the low 32 bits match prep_block checksums */
+struct fine_sink_sum {
+	struct fine_sink sink;
+	uint64_t hash;
+	uint64_t len;
+};
+
+void fine_sink_mem_init(struct fine_sink_mem *mem, void *buf, uint32_t size);
+void fine_sink_fd_init(struct fine_sink_fd *fd, int fd_num);
+void fine_sink_sum_init(struct fine_sink_sum *sum);
+
+/* Append next to the chain starting at sink, returns sink */
+struct fine_sink *fine_sink_chain(struct fine_sink *sink, struct fine_sink *next);
+
+int fine_sink_write(struct fine_sink *sink, const uint8_t *data, uint32_t len);
+
+#endif /* SINK_H */
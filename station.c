@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Station mode: the probe stays open between boards. A start sequence
+ * is sent every poll period; the job starts as soon as a target answers,
+ * and the next board is awaited once this one stopped answering.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "log.h"
+#include "fine.h"
+#include "job.h"
+#include "metrics.h"
+#include "station.h"
+
+static volatile sig_atomic_t station_stop;
+
+static void station_sigint(int sig)
+{
+	(void)sig;
+	station_stop = 1;
+}
+
+/* Wait for the target to answer (attach) or to stay silent for a few
+ * polls (detach). *when is the time of the poll that saw the change, on
+ * the session clock like every station time. A failed poll counts as no
+ * answer, as a board pulled mid-poll is a normal event; only a probe
+ * that keeps failing ends the station.
+ */
+static int station_wait(struct fine_session *s, bool attach, uint32_t poll_ms,
+			uint64_t *when)
+{
+	int absent = 0;
+	int errors = 0;
+	bool present;
+	int ret;
+
+	while (!station_stop) {
+		ret = fine_probe_target(s, &present);
+		if (ret != EXIT_SUCCESS) {
+			if (++errors == STATION_PROBE_ERRORS) {
+				LOG_TAG_ERROR(fine_get_tag(s), "Station: probe failed");
+				return EXIT_FAILURE;
+			}
+			present = false;
+		} else {
+			errors = 0;
+		}
+
+		absent = present ? 0 : absent + 1;
+
+		if ((attach && present) ||
+		    (!attach && absent == STATION_DETACH_POLLS)) {
+			*when = fine_now_ns(s);
+			return EXIT_SUCCESS;
+		}
+
+		usleep(poll_ms * 1000);
+	}
+
+	return EXIT_FAILURE;
+}
+
+int station_run(struct fine_session *s, struct job *job, int boards,
+		uint32_t poll_ms)
+{
+	uint64_t first_byte_sum = 0, first_byte_min = UINT64_MAX, first_byte_max = 0;
+	uint64_t cycle_sum = 0;
+	int first_byte_count = 0;
+	uint64_t start = fine_now_ns(s);
+	uint64_t attach, detach, end;
+	int passed = 0, failed = 0;
+	int n = 0;
+
+	station_stop = 0;
+	signal(SIGINT, station_sigint);
+
+	while (!station_stop && (!boards || n < boards)) {
+		printf("Station: waiting for board %d\n", n + 1);
+		fflush(stdout);
+
+		if (station_wait(s, true, poll_ms, &attach))
+			break;
+
+		job_reset(job);
+		int ret = job_run(job, s);
+		end = fine_now_ns(s);
+		n++;
+
+		if (ret == EXIT_SUCCESS) {
+			passed++;
+		} else {
+			failed++;
+			job_report(job);
+		}
+
+		cycle_sum += end - attach;
+		metrics_board(ret == EXIT_SUCCESS, end - attach);
+		metrics_flush();
+
+		if (job->first_write_ns) {
+			uint64_t lat = job->first_write_ns - attach;
+
+			first_byte_sum += lat;
+			first_byte_count++;
+			if (lat < first_byte_min)
+				first_byte_min = lat;
+			if (lat > first_byte_max)
+				first_byte_max = lat;
+
+			printf("Station: board %d %s in %.1f ms, first write %.1f ms after attach\n",
+				n, ret == EXIT_SUCCESS ? "PASS" : "FAIL",
+				(end - attach) / 1e6, lat / 1e6);
+		} else {
+			printf("Station: board %d %s in %.1f ms\n", n,
+				ret == EXIT_SUCCESS ? "PASS" : "FAIL",
+				(end - attach) / 1e6);
+		}
+
+		printf("Station: remove board %d\n", n);
+		fflush(stdout);
+
+		if (station_wait(s, false, poll_ms, &detach))
+			break;
+	}
+
+	signal(SIGINT, SIG_DFL);
+
+	end = fine_now_ns(s);
+
+	printf("Station: %d boards, %d passed, %d failed\n", n, passed, failed);
+	if (!n)
+		return EXIT_SUCCESS;
+
+	printf("Station: mean cycle %.1f ms, %.0f boards/hour\n", cycle_sum / 1e6 / n,
+		n * 3600e9 / (end - start));
+
+	if (first_byte_count)
+		printf("Station: attach to first write min %.1f / mean %.1f / max %.1f ms\n",
+			first_byte_min / 1e6, first_byte_sum / 1e6 / first_byte_count,
+			first_byte_max / 1e6);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
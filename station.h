@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATION_H
+#define STATION_H
+
+#include <stdint.h>
+
+#define STATION_POLL_MS			10
+#define STATION_DETACH_POLLS		3
+#define STATION_PROBE_ERRORS		100	/* in a row, the probe is gone */
+
+struct job;
+struct fine_session;
+
+/* Keep the probe open and run the job on every board put in the
+ * fixture. boards == 0 runs until interrupted.
+ */
+int station_run(struct fine_session *s, struct job *job, int boards,
+		uint32_t poll_ms);
+
+#endif /* STATION_H */
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Trace file layout, in host byte order:
+ *
+ *   struct trace_file_header
+ *   then for each exchange:
+ *     struct trace_record
+ *     uint8_t out[out_len]
+ *     uint8_t in[in_len]		only when ret is JAYLINK_OK
+ *
+ * Times are relative to the creation of the recorder, on the clock of
+ * the transport it records (virtual in a dry run).
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "transport.h"
+#include "trace.h"
+
+#define TRACE_MAGIC			"RXTRACE"
+#define TRACE_VERSION			1
+
+struct trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct trace_record {
+	uint64_t start_ns;
+	uint64_t ns;
+	uint32_t out_len;
+	uint32_t in_len;
+	uint32_t timeout;
+	int32_t ret;
+};
+
+struct trace_recorder {
+	struct fine_transport t;
+	struct fine_transport *inner;
+	const char *path;
+	FILE *f;
+	uint64_t base_ns;
+	uint32_t count;
+	bool failed;
+};
+
+static void trace_write_error(struct trace_recorder *rec)
+{
+	if (!rec->failed)
+		LOG_ERROR("Can't write trace %s: %s, recording stopped", rec->path,
+			  strerror(errno));
+	rec->failed = true;
+}
+
+static int trace_record_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+			   uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct trace_recorder *rec = t->priv;
+	struct trace_record r;
+	uint64_t start = transport_now_ns(rec->inner);
+	int ret;
+
+	ret = rec->inner->io(rec->inner, out, in, out_len, in_len, timeout);
+
+	if (rec->failed)
+		return ret;
+
+	r.start_ns = start - rec->base_ns;
+	r.ns = transport_now_ns(rec->inner) - start;
+	r.out_len = out_len;
+	r.in_len = in_len;
+	r.timeout = timeout;
+	r.ret = ret;
+
+	if (fwrite(&r, sizeof(r), 1, rec->f) != 1 ||
+	    (out_len && fwrite(out, out_len, 1, rec->f) != 1) ||
+	    (ret == JAYLINK_OK && in_len && fwrite(in, in_len, 1, rec->f) != 1))
+		trace_write_error(rec);
+	else
+		rec->count++;
+
+	return ret;
+}
+
+static uint64_t trace_record_now(struct fine_transport *t)
+{
+	struct trace_recorder *rec = t->priv;
+
+	return transport_now_ns(rec->inner);
+}
+
+static void trace_record_free(struct fine_transport *t)
+{
+	struct trace_recorder *rec = t->priv;
+
+	if (fclose(rec->f))
+		trace_write_error(rec);
+	else if (!rec->failed)
+		printf("%" PRIu32 " exchanges recorded to %s\n", rec->count, rec->path);
+
+	transport_free(rec->inner);
+	free(rec);
+}
+
+struct fine_transport *trace_record_new(struct fine_transport *inner,
+					const char *path)
+{
+	struct trace_file_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+	};
+	struct trace_recorder *rec;
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return NULL;
+
+	rec->f = fopen(path, "wb");
+	if (!rec->f) {
+		LOG_ERROR("Can't create trace %s: %s", path, strerror(errno));
+		goto err;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->f) != 1) {
+		LOG_ERROR("Can't write trace %s: %s", path, strerror(errno));
+		fclose(rec->f);
+		goto err;
+	}
+
+	rec->t.name = inner->name;
+	rec->t.io = trace_record_io;
+	rec->t.free = trace_record_free;
+	rec->t.now = trace_record_now;
+	rec->t.priv = rec;
+	rec->inner = inner;
+	rec->path = path;
+	rec->base_ns = transport_now_ns(inner);
+
+	return &rec->t;
+
+err:
+	free(rec);
+	return NULL;
+}
+
+struct trace_player {
+	struct fine_transport t;
+	const char *path;
+	uint8_t *map;
+	size_t map_len;
+	size_t pos;			/* next record */
+	uint32_t count;			/* records served */
+	bool realtime;
+	uint64_t start_ns;		/* monotonic time the replay started */
+	uint64_t clock_ns;		/* end of the last record served */
+};
+
+static int trace_replay_io(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+			   uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	struct trace_player *play = t->priv;
+	struct trace_record r;
+	const uint8_t *data;
+	size_t left = play->map_len - play->pos;
+	size_t len;
+
+	(void)timeout;
+
+	if (left < sizeof(r)) {
+		LOG_ERROR("%s: trace ends after %" PRIu32 " exchanges", play->path,
+			  play->count);
+		return JAYLINK_ERR;
+	}
+
+	memcpy(&r, &play->map[play->pos], sizeof(r));
+	data = &play->map[play->pos + sizeof(r)];
+	len = (size_t)r.out_len + (r.ret == JAYLINK_OK ? r.in_len : 0);
+
+	if (left - sizeof(r) < len) {
+		LOG_ERROR("%s: truncated at exchange %" PRIu32, play->path, play->count);
+		return JAYLINK_ERR;
+	}
+
+	if (r.out_len != out_len || r.in_len != in_len || memcmp(data, out, out_len)) {
+		LOG_ERROR("%s: exchange %" PRIu32 " differs from the trace", play->path,
+			  play->count);
+		return JAYLINK_ERR;
+	}
+
+	if (r.ret == JAYLINK_OK)
+		memcpy(in, data + out_len, in_len);
+
+	play->pos += sizeof(r) + len;
+	play->count++;
+	play->clock_ns = r.start_ns + r.ns;
+
+	if (play->realtime) {
+		uint64_t end = play->start_ns + play->clock_ns;
+		uint64_t now = monotonic_ns();
+
+		if (end > now) {
+			struct timespec ts = {
+				.tv_sec = (end - now) / 1000000000,
+				.tv_nsec = (end - now) % 1000000000,
+			};
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return r.ret;
+}
+
+static uint64_t trace_replay_now(struct fine_transport *t)
+{
+	struct trace_player *play = t->priv;
+
+	return play->clock_ns;
+}
+
+static void trace_replay_free(struct fine_transport *t)
+{
+	struct trace_player *play = t->priv;
+
+	if (play->pos != play->map_len)
+		LOG_WARNING("%s: %" PRIu32 " exchanges replayed, trace goes on",
+			    play->path, play->count);
+
+	munmap(play->map, play->map_len);
+	free(play);
+}
+
+struct fine_transport *trace_replay_new(const char *path, bool realtime)
+{
+	const struct trace_file_header *hdr;
+	struct trace_player *play;
+	struct stat st;
+	uint8_t *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Can't open trace %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*hdr)) {
+		LOG_ERROR("%s: not a trace", path);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		LOG_ERROR("Can't map trace %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	hdr = (const struct trace_file_header *)map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TRACE_VERSION) {
+		LOG_ERROR("%s: not a trace, or an unsupported version", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	play = calloc(1, sizeof(*play));
+	if (!play) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	play->t.name = "replay";
+	play->t.io = trace_replay_io;
+	play->t.free = trace_replay_free;
+	play->t.now = realtime ? NULL : trace_replay_now;
+	play->t.priv = play;
+	play->path = path;
+	play->map = map;
+	play->map_len = st.st_size;
+	play->pos = sizeof(*hdr);
+	play->realtime = realtime;
+	play->start_ns = monotonic_ns();
+
+	return &play->t;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct fine_transport;
+
+/* Traces of FINE traffic.
+ *
+ * The recorder sits in front of another transport and appends every
+ * exchange to a file: when it started, how long it took, the request,
+ * the return code and, if it succeeded, the answer.
+ *
+ * The replay transport serves a trace back, checking that each request
+ * matches the recorded one. With realtime set, answers come at the
+ * recorded pace. Otherwise they come at once, and the transport clock
+ * follows the trace so reports show the recorded times.
+ */
+struct fine_transport *trace_record_new(struct fine_transport *inner,
+					const char *path);
+struct fine_transport *trace_replay_new(const char *path, bool realtime);
+
+#endif /* TRACE_H */
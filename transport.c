@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjaylink/libjaylink.h>
+
+#include "helpers.h"
+#include "log.h"
+#include "metrics.h"
+#include "sink.h"
+#include "transport.h"
+
+static int transport_jaylink_io(struct fine_transport *t, const uint8_t *out,
+				uint8_t *in, uint32_t out_len, uint32_t in_len,
+				uint32_t timeout)
+{
+	return jaylink_fine_io(t->priv, out, in, out_len, in_len, timeout);
+}
+
+static void transport_jaylink_free(struct fine_transport *t)
+{
+	free(t);
+}
+
+struct fine_transport *transport_jaylink_new(struct jaylink_device_handle *devh)
+{
+	struct fine_transport *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+
+	t->name = "jlink";
+	t->io = transport_jaylink_io;
+	t->free = transport_jaylink_free;
+	t->priv = devh;
+
+	return t;
+}
+
+void transport_free(struct fine_transport *t)
+{
+	if (t)
+		t->free(t);
+}
+
+uint64_t transport_now_ns(struct fine_transport *t)
+{
+	if (t && t->now)
+		return t->now(t);
+
+	return monotonic_ns();
+}
+
+void fine_queue_init(struct fine_queue *q, struct fine_transport *t)
+{
+	memset(q, 0, sizeof(*q));
+	q->t = t;
+	q->out_max = FINE_QUEUE_OUT_MAX;
+	q->in_max = FINE_QUEUE_IN_MAX;
+	q->ops_max = FINE_QUEUE_OPS_MAX;
+}
+
+void fine_queue_reset(struct fine_queue *q)
+{
+	q->out_len = 0;
+	q->in_len = 0;
+	q->num_ops = 0;
+	q->timeout = 0;
+	q->done_handle = q->next_handle;
+	q->error = JAYLINK_OK;
+}
+
+int fine_queue_flush(struct fine_queue *q)
+{
+	uint32_t off = 0;
+	int ret;
+
+	if (!q->num_ops)
+		return q->error;
+
+	if (q->error == JAYLINK_OK) {
+		uint64_t start = transport_now_ns(q->t);
+
+		ret = q->t->io(q->t, q->out, q->in, q->out_len, q->in_len, q->timeout);
+		metrics_exchange(q->out_len, q->in_len, transport_now_ns(q->t) - start, ret);
+		if (ret != JAYLINK_OK) {
+			LOG_ERROR("FINE xfer failed: %s", jaylink_strerror(ret));
+			q->error = ret;
+		}
+
+		q->total_ops += q->num_ops;
+		q->total_flushes++;
+	}
+
+	for (int i = 0; i < q->num_ops && q->error == JAYLINK_OK; i++) {
+		if (q->ops[i].in)
+			memcpy(q->ops[i].in, &q->in[off], q->ops[i].in_len);
+		else if (q->ops[i].sink)
+			fine_sink_write(q->ops[i].sink, &q->in[off], q->ops[i].in_len);
+		off += q->ops[i].in_len;
+	}
+
+	q->out_len = 0;
+	q->in_len = 0;
+	q->num_ops = 0;
+	q->timeout = 0;
+	q->done_handle = q->next_handle;
+
+	return q->error;
+}
+
+static int64_t fine_queue_add(struct fine_queue *q, const uint8_t *out,
+			      uint8_t *in, struct fine_sink *sink,
+			      uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	int ret;
+
+	if (out_len > q->out_max || in_len > q->in_max)
+		return JAYLINK_ERR_ARG;
+
+	if (q->out_len + out_len > q->out_max || q->in_len + in_len > q->in_max ||
+	    q->num_ops == q->ops_max) {
+		ret = fine_queue_flush(q);
+		if (ret != JAYLINK_OK)
+			return ret;
+	}
+
+	if (q->error != JAYLINK_OK)
+		return q->error;
+
+	memcpy(&q->out[q->out_len], out, out_len);
+	q->out_len += out_len;
+	q->in_len += in_len;
+	if (timeout > q->timeout)
+		q->timeout = timeout;
+
+	q->ops[q->num_ops].in = in;
+	q->ops[q->num_ops].sink = sink;
+	q->ops[q->num_ops].in_len = in_len;
+	q->num_ops++;
+
+	return q->next_handle++;
+}
+
+/* Queue one exchange. in may be NULL when the answer is not needed.
+ * Returns a handle for fine_queue_result(), or a negative error.
+ */
+int64_t fine_queue_io(struct fine_queue *q, const uint8_t *out, uint8_t *in,
+		      uint32_t out_len, uint32_t in_len, uint32_t timeout)
+{
+	return fine_queue_add(q, out, in, NULL, out_len, in_len, timeout);
+}
+
+/* Same, the answer going to sink when the exchange completes */
+int64_t fine_queue_io_sink(struct fine_queue *q, const uint8_t *out,
+			   struct fine_sink *sink, uint32_t out_len,
+			   uint32_t in_len, uint32_t timeout)
+{
+	return fine_queue_add(q, out, NULL, sink, out_len, in_len, timeout);
+}
+
+/* Wait for a queued exchange, flushing if it has not been sent yet */
+int fine_queue_result(struct fine_queue *q, int64_t handle)
+{
+	if (handle < 0)
+		return handle;
+
+	if ((uint64_t)handle >= q->done_handle)
+		return fine_queue_flush(q);
+
+	return q->error;
+}
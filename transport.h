@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2021 Franck Jullien <franck.jullien@collshade.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct jaylink_device_handle;
+struct fine_sink;
+
+/* One FINE exchange: out_len bytes of FINE sub-commands, in_len bytes of
+ * target answers. Returns JAYLINK_OK or a libjaylink error code.
+ * now is optional: a transport running on a clock of its own (dry run)
+ * provides it, otherwise the monotonic clock is used.
+ */
+struct fine_transport {
+	const char *name;
+	int (*io)(struct fine_transport *t, const uint8_t *out, uint8_t *in,
+		  uint32_t out_len, uint32_t in_len, uint32_t timeout);
+	void (*free)(struct fine_transport *t);
+	uint64_t (*now)(struct fine_transport *t);
+	void *priv;
+};
+
+struct fine_transport *transport_jaylink_new(struct jaylink_device_handle *devh);
+void transport_free(struct fine_transport *t);
+uint64_t transport_now_ns(struct fine_transport *t);
+
+#define FINE_QUEUE_OUT_MAX		512
+#define FINE_QUEUE_IN_MAX		512
+#define FINE_QUEUE_OPS_MAX		192	/* a full buffer of packet words and acks */
+
+/* Deferred transactions. Sub-commands are appended to one buffer and
+ * sent in a single exchange when a result is needed, when the buffer
+ * would overflow or on fine_queue_flush(). Answers are scattered back to
+ * the buffers given when queueing, or handed to a sink straight from the
+ * exchange buffer; a sink keeps track of its own errors. Errors are
+ * sticky: once a flush fails, every later call returns that error until
+ * fine_queue_reset().
+ */
+struct fine_queue_op {
+	uint8_t *in;
+	struct fine_sink *sink;
+	uint32_t in_len;
+};
+
+struct fine_queue {
+	struct fine_transport *t;
+
+	/* Limits, at most the FINE_QUEUE_*_MAX values */
+	uint32_t out_max;
+	uint32_t in_max;
+	int ops_max;
+
+	uint8_t out[FINE_QUEUE_OUT_MAX];
+	uint8_t in[FINE_QUEUE_IN_MAX];
+	uint32_t out_len;
+	uint32_t in_len;
+	uint32_t timeout;
+	struct fine_queue_op ops[FINE_QUEUE_OPS_MAX];
+	int num_ops;
+
+	uint64_t next_handle;		/* handle of the next queued op */
+	uint64_t done_handle;		/* ops below this one completed */
+	int error;
+
+	uint64_t total_ops;
+	uint64_t total_flushes;
+};
+
+void fine_queue_init(struct fine_queue *q, struct fine_transport *t);
+int64_t fine_queue_io(struct fine_queue *q, const uint8_t *out, uint8_t *in,
+		      uint32_t out_len, uint32_t in_len, uint32_t timeout);
+int64_t fine_queue_io_sink(struct fine_queue *q, const uint8_t *out,
+			   struct fine_sink *sink, uint32_t out_len,
+			   uint32_t in_len, uint32_t timeout);
+int fine_queue_flush(struct fine_queue *q);
+int fine_queue_result(struct fine_queue *q, int64_t handle);
+void fine_queue_reset(struct fine_queue *q);
+
+#endif /* TRANSPORT_H */